@@ -0,0 +1,539 @@
+#include "vcalloc/vcalloc.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Multi-thread and multi-process allocator benchmarks. Every configuration
+// runs in its own child process against a fresh segment (or a fresh glibc
+// heap) and prints one CSV row. Processes attach to the segment created by
+// their parent, which is how vcalloc is shared in production.
+
+const key_t kBenchKey = 0x76630300;
+const int kMaxWorkers = 64;
+const int kLatencySampleEvery = 16;
+const int kSlots = 1024;
+const int kRingSize = 1024;
+const int kLarsonGenerations = 8;
+
+struct Allocator {
+  const char *name_;
+  void *(*malloc_)(size_t size);
+  void (*free_)(void *ptr);
+  // Turn a pointer into a value another worker can free from, and back
+  uint64_t (*encode_)(void *ptr);
+  void *(*decode_)(uint64_t value);
+  // Whether encoded pointers stay valid in other processes
+  bool shared_;
+};
+
+static vcalloc *bench_vcalloc = nullptr;
+
+static void *VcallocMalloc(size_t size) {
+  return bench_vcalloc->Malloc(size);
+}
+static void VcallocFree(void *ptr) { bench_vcalloc->Free(ptr); }
+static uint64_t VcallocEncode(void *ptr) {
+  return bench_vcalloc->ToOffset(ptr);
+}
+static void *VcallocDecode(uint64_t value) {
+  return bench_vcalloc->FromOffset(value);
+}
+
+static void *SystemMalloc(size_t size) { return malloc(size); }
+static void SystemFree(void *ptr) { free(ptr); }
+static uint64_t SystemEncode(void *ptr) { return uint64_t(ptr); }
+static void *SystemDecode(uint64_t value) { return (void *)value; }
+
+const Allocator kAllocators[] = {
+    {"vcalloc", VcallocMalloc, VcallocFree, VcallocEncode, VcallocDecode,
+     true},
+    {"malloc", SystemMalloc, SystemFree, SystemEncode, SystemDecode, false},
+};
+
+// Log-linear latency histogram that can be merged across processes
+struct Histogram {
+  static const int kSubBits = 3;
+  static const int kBuckets = 64 << kSubBits;
+  uint64_t counts_[kBuckets];
+
+  static int Bucket(uint64_t ns) {
+    if (ns < (1 << kSubBits)) {
+      return int(ns);
+    }
+    const int high = 63 - __builtin_clzll(ns);
+    const int sub = int(ns >> (high - kSubBits)) & ((1 << kSubBits) - 1);
+    return ((high - kSubBits + 1) << kSubBits) + sub;
+  }
+
+  static uint64_t UpperBound(int bucket) {
+    if (bucket < (1 << kSubBits)) {
+      return bucket;
+    }
+    const int high = (bucket >> kSubBits) + kSubBits - 1;
+    const uint64_t sub = bucket & ((1 << kSubBits) - 1);
+    return ((uint64_t(1) << kSubBits | sub) + 1) << (high - kSubBits);
+  }
+
+  void Add(uint64_t ns) { counts_[Bucket(ns)]++; }
+
+  void Merge(const Histogram &other) {
+    for (int i = 0; i < kBuckets; i++) {
+      counts_[i] += other.counts_[i];
+    }
+  }
+
+  uint64_t Percentile(double p) const {
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      total += counts_[i];
+    }
+    const uint64_t rank = uint64_t(p * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen > rank) {
+        return UpperBound(i);
+      }
+    }
+    return 0;
+  }
+};
+
+struct WorkerResult {
+  uint64_t ops_;
+  uint64_t elapsed_ns_;
+  Histogram latency_;
+};
+
+struct RingSlot {
+  std::atomic<uint64_t> value_;
+  std::atomic<uint64_t> sequence_;
+};
+
+// Single-producer single-consumer ring shared by a producer/consumer pair
+struct Ring {
+  RingSlot slots_[kRingSize];
+};
+
+// Lives in a MAP_SHARED mapping so forked workers can report back
+struct SharedState {
+  std::atomic<int> ready_;
+  std::atomic<int> go_;
+  long max_rss_kb_;
+  WorkerResult results_[kMaxWorkers];
+  Ring rings_[kMaxWorkers / 2];
+};
+
+struct Worker {
+  const Allocator *allocator_;
+  SharedState *state_;
+  int index_;
+  uint64_t ops_;
+  uint64_t rng_;
+
+  uint64_t Random() {
+    rng_ ^= rng_ >> 12;
+    rng_ ^= rng_ << 25;
+    rng_ ^= rng_ >> 27;
+    return rng_ * 0x2545f4914f6cdd1dULL;
+  }
+
+  size_t RandomSize(size_t min, size_t max) {
+    return min + Random() % (max - min + 1);
+  }
+
+  WorkerResult &Result() { return state_->results_[index_]; }
+
+  void *Malloc(size_t size, uint64_t op) {
+    if (op % kLatencySampleEvery) {
+      return allocator_->malloc_(size);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    void *ptr = allocator_->malloc_(size);
+    auto t2 = std::chrono::steady_clock::now();
+    Result().latency_.Add((t2 - t1).count());
+    return ptr;
+  }
+
+  void Free(void *ptr, uint64_t op) {
+    if (op % kLatencySampleEvery) {
+      allocator_->free_(ptr);
+      return;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    allocator_->free_(ptr);
+    auto t2 = std::chrono::steady_clock::now();
+    Result().latency_.Add((t2 - t1).count());
+  }
+};
+
+// Fixed 64 byte objects with a short window of live allocations
+static uint64_t Churn(Worker &worker) {
+  void *window[16] = {nullptr};
+  uint64_t op = 0;
+  for (uint64_t i = 0; i < worker.ops_; i++) {
+    void *&slot = window[i % 16];
+    if (slot) {
+      worker.Free(slot, op++);
+    }
+    slot = worker.Malloc(64, op++);
+    static_cast<char *>(slot)[0] = 1;
+  }
+  for (void *ptr : window) {
+    worker.Free(ptr, op++);
+  }
+  return op;
+}
+
+// Random sizes replacing random slots of a private working set
+static uint64_t RandomSizes(Worker &worker) {
+  std::vector<void *> slots(kSlots, nullptr);
+  uint64_t op = 0;
+  for (uint64_t i = 0; i < worker.ops_; i++) {
+    void *&slot = slots[worker.Random() % kSlots];
+    if (slot) {
+      worker.Free(slot, op++);
+      slot = nullptr;
+    } else {
+      slot = worker.Malloc(worker.RandomSize(16, 4096), op++);
+      static_cast<char *>(slot)[0] = 1;
+    }
+  }
+  for (void *ptr : slots) {
+    if (ptr) {
+      worker.Free(ptr, op++);
+    }
+  }
+  return op;
+}
+
+// Even workers allocate, odd workers free what their partner allocated
+static uint64_t ProducerConsumer(Worker &worker) {
+  Ring &ring = worker.state_->rings_[worker.index_ / 2];
+  const bool producer = worker.index_ % 2 == 0;
+  uint64_t op = 0;
+  for (uint64_t i = 0; i < worker.ops_; i++) {
+    RingSlot &slot = ring.slots_[i % kRingSize];
+    if (producer) {
+      while (slot.sequence_.load(std::memory_order_acquire) != i) {
+        std::this_thread::yield();
+      }
+      void *ptr = worker.Malloc(worker.RandomSize(16, 512), op++);
+      slot.value_.store(worker.allocator_->encode_(ptr),
+                        std::memory_order_relaxed);
+      slot.sequence_.store(i + 1, std::memory_order_release);
+    } else {
+      while (slot.sequence_.load(std::memory_order_acquire) != i + 1) {
+        std::this_thread::yield();
+      }
+      void *ptr = worker.allocator_->decode_(
+          slot.value_.load(std::memory_order_relaxed));
+      worker.Free(ptr, op++);
+      slot.sequence_.store(i + kRingSize, std::memory_order_release);
+    }
+  }
+  return op;
+}
+
+/*
+** Larson: a lane keeps replacing random objects, and every generation the
+** lane is handed to a fresh thread, so objects are freed by threads other
+** than the one that allocated them.
+*/
+static uint64_t Larson(Worker &worker) {
+  std::vector<void *> slots(kSlots, nullptr);
+  std::atomic<uint64_t> op(0);
+  const uint64_t per_generation = worker.ops_ / kLarsonGenerations;
+  for (int generation = 0; generation < kLarsonGenerations; generation++) {
+    std::thread thread([&worker, &slots, &op, per_generation] {
+      uint64_t local = op.load();
+      for (uint64_t i = 0; i < per_generation; i++) {
+        void *&slot = slots[worker.Random() % kSlots];
+        if (slot) {
+          worker.Free(slot, local++);
+        }
+        slot = worker.Malloc(worker.RandomSize(16, 1024), local++);
+        static_cast<char *>(slot)[0] = 1;
+      }
+      op.store(local);
+    });
+    thread.join();
+  }
+  uint64_t local = op.load();
+  for (void *ptr : slots) {
+    if (ptr) {
+      worker.Free(ptr, local++);
+    }
+  }
+  return local;
+}
+
+struct Workload {
+  const char *name_;
+  uint64_t (*run_)(Worker &worker);
+  // Workers exchange pointers, so processes need a shared allocator
+  bool exchanges_;
+};
+
+const Workload kWorkloads[] = {
+    {"churn", Churn, false},
+    {"random", RandomSizes, false},
+    {"prodcons", ProducerConsumer, true},
+    {"larson", Larson, false},
+};
+
+static void RunWorker(const Allocator &allocator, const Workload &workload,
+                      SharedState *state, int index, uint64_t ops) {
+  Worker worker;
+  worker.allocator_ = &allocator;
+  worker.state_ = state;
+  worker.index_ = index;
+  worker.ops_ = ops;
+  worker.rng_ = 0x9e3779b97f4a7c15ULL * (index + 1);
+
+  state->ready_.fetch_add(1);
+  while (!state->go_.load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  const uint64_t done = workload.run_(worker);
+  auto t2 = std::chrono::steady_clock::now();
+  worker.Result().ops_ = done;
+  worker.Result().elapsed_ns_ = (t2 - t1).count();
+}
+
+static void WaitReady(SharedState *state, int workers) {
+  while (state->ready_.load() != workers) {
+    std::this_thread::yield();
+  }
+  state->go_.store(1, std::memory_order_release);
+}
+
+static void RemoveSegment() {
+  int shmid = shmget(kBenchKey, 0, 0);
+  if (shmid >= 0) {
+    shmctl(shmid, IPC_RMID, nullptr);
+  }
+}
+
+static void AttachVcalloc(size_t pool_size) {
+  vcalloc::Options options;
+  options.key = kBenchKey;
+  options.size = pool_size;
+  RemoveSegment();
+  bench_vcalloc = new vcalloc(options);
+  RemoveSegment();
+}
+
+static long MaxRssKb(int who) {
+  struct rusage usage;
+  getrusage(who, &usage);
+  return usage.ru_maxrss;
+}
+
+// Run one configuration in a child process and print its CSV row
+static void RunConfig(const Allocator &allocator, const Workload &workload,
+                      int threads, int processes, uint64_t ops,
+                      size_t pool_size) {
+  const int workers = threads * processes;
+  if (workers > kMaxWorkers ||
+      (workload.exchanges_ && processes > 1 && !allocator.shared_)) {
+    return;
+  }
+  void *mem = mmap(nullptr, sizeof(SharedState), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    return;
+  }
+  SharedState *state = new (mem) SharedState();
+  for (auto &ring : state->rings_) {
+    for (int i = 0; i < kRingSize; i++) {
+      ring.slots_[i].sequence_.store(i);
+    }
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (allocator.malloc_ == VcallocMalloc) {
+      AttachVcalloc(pool_size);
+    }
+    if (processes == 1) {
+      std::vector<std::thread> pool;
+      for (int i = 0; i < threads; i++) {
+        pool.emplace_back(RunWorker, std::cref(allocator),
+                          std::cref(workload), state, i, ops);
+      }
+      WaitReady(state, workers);
+      for (auto &thread : pool) {
+        thread.join();
+      }
+      state->max_rss_kb_ = MaxRssKb(RUSAGE_SELF);
+    } else {
+      for (int i = 0; i < processes; i++) {
+        if (fork() == 0) {
+          RunWorker(allocator, workload, state, i, ops);
+          _exit(0);
+        }
+      }
+      WaitReady(state, workers);
+      while (wait(nullptr) > 0) {
+      }
+      state->max_rss_kb_ = MaxRssKb(RUSAGE_CHILDREN);
+    }
+    _exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+
+  uint64_t total_ops = 0;
+  uint64_t elapsed_ns = 0;
+  Histogram latency;
+  memset(&latency, 0, sizeof(latency));
+  for (int i = 0; i < workers; i++) {
+    total_ops += state->results_[i].ops_;
+    elapsed_ns = Max(elapsed_ns, state->results_[i].elapsed_ns_);
+    latency.Merge(state->results_[i].latency_);
+  }
+  printf("%s,%s,%d,%d,%llu,%.0f,%llu,%llu,%llu,%ld,\n", workload.name_,
+         allocator.name_, threads, processes, (unsigned long long)total_ops,
+         elapsed_ns ? total_ops * 1e9 / elapsed_ns : 0.0,
+         (unsigned long long)latency.Percentile(0.5),
+         (unsigned long long)latency.Percentile(0.99),
+         (unsigned long long)latency.Percentile(0.999), state->max_rss_kb_);
+  fflush(stdout);
+  munmap(mem, sizeof(SharedState));
+}
+
+/*
+** Fragmentation over time: a single thread with long and short lived
+** objects of mixed sizes. Rows report RSS and, for vcalloc, 1 - largest
+** free block / total free space at every checkpoint.
+*/
+static void RunFragmentation(const Allocator &allocator, uint64_t ops,
+                             size_t pool_size) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (allocator.malloc_ == VcallocMalloc) {
+      AttachVcalloc(pool_size);
+    }
+    Worker worker;
+    memset(&worker, 0, sizeof(worker));
+    worker.rng_ = 42;
+    std::vector<void *> slots(16 * kSlots, nullptr);
+    const uint64_t checkpoint = Max(ops / 10, uint64_t(1));
+    for (uint64_t i = 1; i <= ops; i++) {
+      // Low slots turn over rarely and hold the long lived objects
+      const bool long_lived = worker.Random() % 8 == 0;
+      const size_t index =
+          long_lived ? worker.Random() % kSlots
+                     : kSlots + worker.Random() % (15 * kSlots);
+      void *&slot = slots[index];
+      if (slot) {
+        allocator.free_(slot);
+        slot = nullptr;
+      } else {
+        const size_t size = worker.Random() % 16 == 0
+                                ? worker.RandomSize(4096, 65536)
+                                : worker.RandomSize(16, 1024);
+        slot = allocator.malloc_(size);
+        memset(slot, 1, Min(size, size_t(64)));
+      }
+      if (i % checkpoint == 0) {
+        printf("fragmentation,%s,1,1,%llu,,,,,%ld,", allocator.name_,
+               (unsigned long long)i, MaxRssKb(RUSAGE_SELF));
+        if (bench_vcalloc) {
+          printf("%.4f", bench_vcalloc->GetFragmentation());
+        }
+        printf("\n");
+      }
+    }
+    fflush(stdout);
+    _exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-n ops] [-t max_threads] [-p max_processes] "
+          "[-s pool_size] [-w workload] [-a allocator]\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  uint64_t ops = 200000;
+  int max_threads = Min(int(std::thread::hardware_concurrency()), 8);
+  int max_processes = max_threads;
+  size_t pool_size = 256 * 1024 * 1024;
+  std::string only_workload;
+  std::string only_allocator;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:t:p:s:w:a:")) != -1) {
+    switch (opt) {
+    case 'n':
+      ops = strtoull(optarg, nullptr, 0);
+      break;
+    case 't':
+      max_threads = atoi(optarg);
+      break;
+    case 'p':
+      max_processes = atoi(optarg);
+      break;
+    case 's':
+      pool_size = strtoull(optarg, nullptr, 0);
+      break;
+    case 'w':
+      only_workload = optarg;
+      break;
+    case 'a':
+      only_allocator = optarg;
+      break;
+    default:
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  max_threads = Max(max_threads, 2);
+  max_processes = Max(max_processes, 2);
+
+  printf("workload,allocator,threads,processes,ops,ops_per_sec,p50_ns,"
+         "p99_ns,p999_ns,max_rss_kb,fragmentation\n");
+  fflush(stdout);
+  for (const Workload &workload : kWorkloads) {
+    if (!only_workload.empty() && only_workload != workload.name_) {
+      continue;
+    }
+    for (const Allocator &allocator : kAllocators) {
+      if (!only_allocator.empty() && only_allocator != allocator.name_) {
+        continue;
+      }
+      // Producer/consumer needs whole pairs of workers
+      const int step = workload.exchanges_ ? 2 : 1;
+      for (int threads = step; threads <= max_threads; threads *= 2) {
+        RunConfig(allocator, workload, threads, 1, ops, pool_size);
+      }
+      for (int processes = 2; processes <= max_processes; processes *= 2) {
+        RunConfig(allocator, workload, 1, processes, ops, pool_size);
+      }
+    }
+  }
+  if (only_workload.empty() || only_workload == "fragmentation") {
+    for (const Allocator &allocator : kAllocators) {
+      if (only_allocator.empty() || only_allocator == allocator.name_) {
+        RunFragmentation(allocator, ops * 10, pool_size);
+      }
+    }
+  }
+}
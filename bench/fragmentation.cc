@@ -0,0 +1,80 @@
+#include "vcalloc/vcalloc.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <sys/shm.h>
+#include <vector>
+
+// Replays the same seeded workload against each search policy and reports
+// how fragmented the pool is afterwards.
+
+const int kSlots = 16384;
+const int kOps = 2000000;
+const int kReportEvery = 400000;
+const size_t kPoolSize = 128 * 1024 * 1024;
+const key_t kBaseKey = 0x76630100;
+
+size_t static random_size(std::mt19937 &rng) {
+  std::uniform_int_distribution<int> kind(0, 99);
+  const int k = kind(rng);
+  if (k < 80) {
+    return std::uniform_int_distribution<size_t>(16, 512)(rng);
+  } else if (k < 98) {
+    return std::uniform_int_distribution<size_t>(512, 8 * 1024)(rng);
+  }
+  return std::uniform_int_distribution<size_t>(8 * 1024, 256 * 1024)(rng);
+}
+
+void static remove_segment(key_t key) {
+  int shmid = shmget(key, 0, 0);
+  if (shmid >= 0) {
+    shmctl(shmid, IPC_RMID, nullptr);
+  }
+}
+
+void run_policy(SearchPolicy policy, const char *name) {
+  vcalloc::Options options;
+  options.key = kBaseKey + policy;
+  options.size = kPoolSize;
+  options.search_policy = policy;
+
+  remove_segment(options.key);
+  vcalloc allocator(options);
+  // Segment is destroyed once the last attachment goes away
+  remove_segment(options.key);
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> pick(0, kSlots - 1);
+  std::vector<void *> slots(kSlots, nullptr);
+
+  auto t1 = std::chrono::steady_clock::now();
+  for (int op = 1; op <= kOps; op++) {
+    void *&slot = slots[pick(rng)];
+    if (slot) {
+      allocator.Free(slot);
+      slot = nullptr;
+    } else {
+      slot = allocator.Malloc(random_size(rng));
+    }
+    if (op % kReportEvery == 0) {
+      printf("%-8s ops=%-8d usage=%.4f largest_free=%-10zu "
+             "fragmentation=%.4f\n",
+             name, op, allocator.GetUsageRate(),
+             allocator.GetLargestFreeSize(), allocator.GetFragmentation());
+    }
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  auto t = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+  printf("%-8s total=%lldus\n", name, (long long)t.count());
+
+  for (void *ptr : slots) {
+    allocator.Free(ptr);
+  }
+}
+
+int main() {
+  run_policy(kSearchGoodFit, "good");
+  run_policy(kSearchBestFit, "best");
+  run_policy(kSearchAddressOrdered, "address");
+}
@@ -1,12 +1,19 @@
 // #include "tlsf.h"
-// #include "vcalloc/vcalloc.h"
+#include "vcalloc/vcalloc.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <poll.h>
 #include <random>
 #include <stdio.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 size_t static random_size() {
   static std::random_device dev;
@@ -89,6 +96,245 @@ void test_multi_thread() {
   }
 }
 
+// Calloc must hand out zeroed memory however its block was split, merged
+// or reused; every other block is dirtied for the next user
+bool test_calloc() {
+  vcalloc &allocator = Global::GetAllocator();
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<size_t> small_size(1, 16 * 1024);
+  std::vector<std::pair<unsigned char *, size_t>> live;
+  for (int i = 0; i < 100000; i++) {
+    if (live.empty() || (live.size() < 256 && rng() % 3)) {
+      const size_t size = i % 1000 ? small_size(rng) : 1024 * 1024;
+      unsigned char *ptr;
+      if (rng() % 2) {
+        ptr = static_cast<unsigned char *>(allocator.Calloc(1, size));
+        for (size_t j = 0; j < size; j++) {
+          if (ptr[j]) {
+            std::cout << "error: calloc byte " << j << " of " << size
+                      << std::endl;
+            return false;
+          }
+        }
+      } else {
+        ptr = static_cast<unsigned char *>(allocator.Malloc(size));
+      }
+      memset(ptr, 0xa5, size);
+      live.push_back({ptr, size});
+    } else {
+      const size_t k = rng() % live.size();
+      allocator.Free(live[k].first);
+      live[k] = live.back();
+      live.pop_back();
+    }
+  }
+  for (auto &entry : live) {
+    allocator.Free(entry.first);
+  }
+
+  void *empty = allocator.Calloc(0, 16);
+  if (!empty || allocator.Calloc(1, size_t(1) << 62)) {
+    std::cout << "error: calloc edge sizes" << std::endl;
+    return false;
+  }
+  allocator.Free(empty);
+  return true;
+}
+
+static bool fail(const char *what) {
+  std::cout << "error: " << what << std::endl;
+  return false;
+}
+
+static void remove_segment(key_t key) {
+  const int shmid = shmget(key, 0, 0);
+  if (shmid >= 0) {
+    shmctl(shmid, IPC_RMID, nullptr);
+  }
+}
+
+static bool readable(int fd, int timeout_ms = 1000) {
+  pollfd entry = {fd, POLLIN, 0};
+  return poll(&entry, 1, timeout_ms) == 1;
+}
+
+// Runs body in a child and reports whether it exited with 0
+template <typename Body> static bool in_child(Body body) {
+  const pid_t child = fork();
+  if (child == 0) {
+    _exit(body() ? 0 : 1);
+  }
+  int status;
+  return child > 0 && waitpid(child, &status, 0) == child &&
+         WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The MallocAsync queue on a small private segment: notification, cancel,
+// unservable sizes, blocks of exited processes and the fork reset
+bool test_async() {
+  vcalloc::Options options;
+  options.key = 0x7663f001;
+  options.size = 16 * 1024 * 1024;
+  const size_t size = 1024 * 1024;
+  remove_segment(options.key);
+  std::unique_ptr<vcalloc> allocator(new vcalloc(options));
+
+  std::vector<void *> blocks;
+  int fd;
+  while (void *ptr = allocator->MallocAsync(size, &fd)) {
+    blocks.push_back(ptr);
+  }
+  if (fd < 0 || blocks.size() < 4) {
+    return fail("async fill");
+  }
+  if (readable(fd, 0) || allocator->TakeAsync(fd)) {
+    return fail("async ready before any free");
+  }
+  void *freed = blocks.back();
+  blocks.pop_back();
+  allocator->Free(freed);
+  if (!readable(fd) || allocator->TakeAsync(fd) != freed) {
+    return fail("async notification");
+  }
+  blocks.push_back(freed);
+
+  int unservable;
+  if (allocator->MallocAsync(0, &unservable) || unservable != -1 ||
+      allocator->MallocAsync(size_t(1) << 40, &unservable) ||
+      unservable != -1) {
+    return fail("async unservable sizes");
+  }
+
+  // Cancelled while waiting, then once its block was reserved
+  allocator->MallocAsync(size, &fd);
+  allocator->CancelAsync(fd);
+  allocator->MallocAsync(size, &fd);
+  allocator->Free(blocks.back());
+  blocks.pop_back();
+  if (!readable(fd)) {
+    return fail("async reserve");
+  }
+  allocator->CancelAsync(fd);
+  void *ptr = allocator->MallocAsync(size, &fd);
+  if (!ptr) {
+    return fail("async cancel");
+  }
+  blocks.push_back(ptr);
+
+  // A forked child gets its own bridge thread
+  if (!in_child([&] {
+        int child_fd;
+        allocator->MallocAsync(size, &child_fd);
+        allocator->Free(blocks.back());
+        return child_fd >= 0 && readable(child_fd) &&
+               allocator->TakeAsync(child_fd) == blocks.back();
+      })) {
+    return fail("async after fork");
+  }
+
+  // The child exits before taking its block, Malloc must not wait forever
+  in_child([&] {
+    int child_fd;
+    allocator->MallocAsync(size, &child_fd);
+    allocator->Free(blocks.back());
+    return true;
+  });
+  alarm(30);
+  blocks.back() = allocator->Malloc(size);
+  alarm(0);
+
+  // The destructor gives back the block reserved for its request
+  vcalloc other(options);
+  allocator->MallocAsync(size, &fd);
+  other.Free(other.FromOffset(allocator->ToOffset(blocks.back())));
+  allocator.reset();
+  alarm(30);
+  other.Malloc(size);
+  alarm(0);
+  remove_segment(options.key);
+  return true;
+}
+
+// Children attach to a fresh key at the same time and allocate; the heap
+// is reset once all of them left, and a foreign layout is refused
+bool test_attach() {
+  vcalloc::Options options;
+  options.key = 0x7663f002;
+  options.size = 16 * 1024 * 1024;
+  const int children = 8;
+  remove_segment(options.key);
+
+  int start[2], done[2], finish[2];
+  if (pipe(start) || pipe(done) || pipe(finish)) {
+    return fail("attach pipes");
+  }
+  std::vector<pid_t> pids;
+  for (int i = 0; i < children; i++) {
+    const pid_t child = fork();
+    if (child == 0) {
+      char byte;
+      close(start[1]);
+      close(finish[1]);
+      // Closing start releases every child at once
+      read(start[0], &byte, 1);
+      vcalloc allocator(options);
+      const size_t offset = allocator.ToOffset(allocator.Malloc(1024));
+      write(done[1], &offset, sizeof(offset));
+      // Stay attached until every child has allocated
+      read(finish[0], &byte, 1);
+      _exit(0);
+    }
+    pids.push_back(child);
+  }
+  close(start[0]);
+  close(start[1]);
+  close(finish[0]);
+  std::vector<size_t> offsets(children);
+  for (int i = 0; i < children; i++) {
+    if (read(done[0], &offsets[i], sizeof(size_t)) != sizeof(size_t)) {
+      return fail("attach child");
+    }
+  }
+  close(finish[1]);
+  close(done[0]);
+  close(done[1]);
+  for (pid_t child : pids) {
+    waitpid(child, nullptr, 0);
+  }
+  std::sort(offsets.begin(), offsets.end());
+  if (std::unique(offsets.begin(), offsets.end()) != offsets.end()) {
+    return fail("attach reset a heap in use");
+  }
+  {
+    vcalloc allocator(options);
+    // The blocks the children never freed are gone, so the first block
+    // is handed out again
+    const size_t offset = allocator.ToOffset(allocator.Malloc(1024));
+    if (std::find(offsets.begin(), offsets.end(), offset) == offsets.end()) {
+      return fail("attach did not reset an abandoned heap");
+    }
+  }
+  remove_segment(options.key);
+
+  // Initialized by a build with another layout
+  const int shmid = shmget(options.key, options.size, IPC_CREAT | 0666);
+  ControlHeader *control =
+      static_cast<ControlHeader *>(shmat(shmid, nullptr, 0));
+  control->layout_version_ = kLayoutVersion + 1;
+  control->layout_size_ = sizeof(ControlHeader);
+  control->init_word_ = InitWord(getpid(), kInitDone);
+  shmdt(control);
+  const bool refused = !in_child([&] {
+    vcalloc allocator(options);
+    return true;
+  });
+  remove_segment(options.key);
+  if (!refused) {
+    return fail("attach accepted another layout");
+  }
+  return true;
+}
+
 int main() {
   using std::chrono::duration;
   using std::chrono::duration_cast;
@@ -97,6 +343,10 @@ int main() {
   using std::chrono::milliseconds;
   using std::chrono::nanoseconds;
 
+  if (!test_calloc() || !test_async() || !test_attach()) {
+    return 1;
+  }
+
   auto t1 = high_resolution_clock::now();
   test_new_delete();
   // test_write_read();
@@ -0,0 +1,278 @@
+#include "vcalloc/control.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <vector>
+
+// Walks the blocks of a live vcalloc segment and reports how the pool is
+// laid out. Nothing but the region locks is written. The lock is held for
+// a bounded number of blocks at a time; when a merge may have invalidated
+// the block the walk stopped at, the region is walked again, and after a
+// few attempts the tool holds the lock for one full pass instead. Region
+// locks are not robust, so signals are held off while one is taken.
+
+// Power-of-two size classes of the free block histogram
+constexpr int kWalkClasses = 64;
+
+// Levels of the occupancy map, from an unused cell to a full one
+const char kMapLevels[] = "_.:-=+*#%@";
+
+struct RegionWalk {
+  size_t used_blocks_;
+  size_t used_bytes_;
+  size_t free_blocks_;
+  size_t free_bytes_;
+  size_t largest_free_;
+  size_t class_blocks_[kWalkClasses];
+  size_t class_bytes_[kWalkClasses];
+  size_t class_largest_[kWalkClasses];
+  // Bytes covered by used blocks, per map cell
+  std::vector<size_t> cells_;
+  size_t cell_size_;
+  std::ptrdiff_t base_;
+  int restarts_;
+  bool single_pass_;
+
+  void Reset(ControlHeader *region, int cells) {
+    used_blocks_ = used_bytes_ = 0;
+    free_blocks_ = free_bytes_ = 0;
+    largest_free_ = 0;
+    for (int i = 0; i < kWalkClasses; i++) {
+      class_blocks_[i] = class_bytes_[i] = class_largest_[i] = 0;
+    }
+    base_ = std::ptrdiff_t(region->FirstBlock());
+    cell_size_ = (region->region_size_ + cells - 1) / cells;
+    cells_.assign(cells, 0);
+  }
+
+  void Add(BlockHeader *block) {
+    const size_t size = block->Size();
+    if (block->IsFree()) {
+      const int k = vcalloc_fls_sizet(size);
+      free_blocks_++;
+      free_bytes_ += size;
+      largest_free_ = Max(largest_free_, size);
+      class_blocks_[k]++;
+      class_bytes_[k] += size;
+      class_largest_[k] = Max(class_largest_[k], size);
+      return;
+    }
+    used_blocks_++;
+    used_bytes_ += size;
+    // Spread the block, header included, over the cells it overlaps
+    size_t begin = size_t(std::ptrdiff_t(block) - base_);
+    const size_t end = begin + size + BlockHeader::Overhead();
+    while (begin < end) {
+      const size_t cell = begin / cell_size_;
+      const size_t cell_end = Min(end, (cell + 1) * cell_size_);
+      cells_[Min(cell, cells_.size() - 1)] += cell_end - begin;
+      begin = cell_end;
+    }
+  }
+};
+
+// Dying with a region lock held would hang every attached process
+static void LockRegion(ControlHeader *region, sigset_t *saved) {
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, saved);
+  pthread_mutex_lock(&region->lock_);
+}
+
+static void UnlockRegion(ControlHeader *region, const sigset_t *saved) {
+  pthread_mutex_unlock(&region->lock_);
+  pthread_sigmask(SIG_SETMASK, saved, nullptr);
+}
+
+static void WalkRegion(ControlHeader *region, size_t chunk, int retries,
+                       int cells, RegionWalk &walk) {
+  sigset_t saved;
+  for (int attempt = 0;; attempt++) {
+    const bool single_pass = attempt > retries;
+    walk.Reset(region, cells);
+    bool stale = false;
+    BlockHeader *block = region->FirstBlock();
+    LockRegion(region, &saved);
+    const size_t generation = region->generation_;
+    while (true) {
+      for (size_t i = 0; (single_pass || i < chunk) && !block->IsLast();
+           i++) {
+        walk.Add(block);
+        block = block->Next();
+      }
+      if (block->IsLast()) {
+        break;
+      }
+      UnlockRegion(region, &saved);
+      sched_yield();
+      LockRegion(region, &saved);
+      if (region->generation_ != generation) {
+        stale = true;
+        break;
+      }
+    }
+    UnlockRegion(region, &saved);
+    if (!stale) {
+      walk.restarts_ = attempt;
+      walk.single_pass_ = single_pass;
+      return;
+    }
+  }
+}
+
+/*
+** Good-fit rounds a request up to the next list, so the only size that is
+** certain to be served is the lower bound of the largest block's list.
+*/
+static size_t GuaranteedSize(size_t largest) {
+  if (largest < size_t(kSmallBlockSize)) {
+    return largest;
+  }
+  const int shift = vcalloc_fls_sizet(largest) - kSLIndexCountLog2;
+  return largest & ~((size_t(1) << shift) - 1);
+}
+
+static void PrintMap(const RegionWalk &walk, int width) {
+  printf("map: cell=%zu bytes, %s = empty .. full\n", walk.cell_size_,
+         kMapLevels);
+  const int levels = int(sizeof(kMapLevels)) - 2;
+  for (size_t i = 0; i < walk.cells_.size(); i++) {
+    if (i % width == 0) {
+      printf("  %012zx ", i * walk.cell_size_);
+    }
+    const size_t used = Min(walk.cells_[i], walk.cell_size_);
+    // Any use at all is visible, only a completely used cell is full
+    const int level = int((used * levels + walk.cell_size_ - 1) /
+                          walk.cell_size_);
+    putchar(kMapLevels[level]);
+    if (i % width == size_t(width) - 1 || i == walk.cells_.size() - 1) {
+      putchar('\n');
+    }
+  }
+}
+
+static void PrintRegion(int index, ControlHeader *region,
+                        const RegionWalk &walk, int width) {
+  printf("region=%d node=%d size=%zu restarts=%d%s\n", index, region->node_,
+         region->region_size_, walk.restarts_,
+         walk.single_pass_ ? " (single pass)" : "");
+  printf("used_blocks=%zu used_bytes=%zu free_blocks=%zu free_bytes=%zu\n",
+         walk.used_blocks_, walk.used_bytes_, walk.free_blocks_,
+         walk.free_bytes_);
+
+  const size_t entry_size = BlockHeader::Overhead();
+  printf("%-6s %12s %16s %16s %12s\n", "class", "free_blocks", "free_bytes",
+         "largest", "fits");
+  for (int k = 0; k < kWalkClasses; k++) {
+    if (!walk.class_blocks_[k]) {
+      continue;
+    }
+    // Requests of the class's lower bound the free blocks could serve,
+    // each split paying one header
+    const size_t request = AdjustRequestSize(size_t(1) << k);
+    size_t fits = 0;
+    for (int j = k; j < kWalkClasses && request; j++) {
+      if (walk.class_blocks_[j]) {
+        fits += (walk.class_bytes_[j] +
+                 walk.class_blocks_[j] * entry_size) /
+                (request + entry_size);
+      }
+    }
+    printf("2^%-4d %12zu %16zu %16zu %12zu\n", k, walk.class_blocks_[k],
+           walk.class_bytes_[k], walk.class_largest_[k], fits);
+  }
+
+  /*
+  ** Packing every used block together would leave one free block holding
+  ** all free bytes plus the headers of the blocks that merged into it.
+  */
+  const size_t compacted =
+      walk.free_blocks_
+          ? walk.free_bytes_ + (walk.free_blocks_ - 1) * entry_size
+          : 0;
+  printf("largest_free=%zu largest_allocatable=%zu\n", walk.largest_free_,
+         GuaranteedSize(walk.largest_free_));
+  printf("compaction: largest_free %zu -> %zu, recovers %zu bytes\n",
+         walk.largest_free_, compacted, compacted - walk.largest_free_);
+  PrintMap(walk, width);
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-c chunk] [-r retries] [-m cells] [-w width] key\n"
+          "  chunk    blocks walked per lock hold (default 1024)\n"
+          "  retries  walks restarted after a merge before holding the\n"
+          "           lock for a single pass (default 3)\n"
+          "  cells    occupancy map cells per region (default 512)\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  size_t chunk = 1024;
+  int retries = 3;
+  int cells = 512;
+  int width = 64;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:m:w:")) != -1) {
+    if (opt == 'c') {
+      chunk = Max(strtoull(optarg, nullptr, 0), 1ULL);
+    } else if (opt == 'r') {
+      retries = atoi(optarg);
+    } else if (opt == 'm') {
+      cells = Max(atoi(optarg), 1);
+    } else if (opt == 'w') {
+      width = Max(atoi(optarg), 1);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1) {
+    Usage(argv[0]);
+    return 1;
+  }
+  const key_t key = key_t(strtol(argv[optind], nullptr, 0));
+
+  // Attach only, never create or initialize a segment
+  const int shmid = shmget(key, 0, 0);
+  if (shmid < 0) {
+    fprintf(stderr, "no segment with key 0x%x\n", (unsigned int)key);
+    return 1;
+  }
+  void *mem = shmat(shmid, nullptr, 0);
+  if (mem == (void *)-1) {
+    perror("shmat");
+    return 1;
+  }
+
+  ControlHeader *control = static_cast<ControlHeader *>(mem);
+  const uint64_t init_word =
+      __atomic_load_n(&control->init_word_, __ATOMIC_ACQUIRE);
+  if ((init_word & 0xffffffff) != kInitDone || !control->LayoutMatches()) {
+    fprintf(stderr, "segment 0x%x is not initialized or has another layout\n",
+            (unsigned int)key);
+    shmdt(mem);
+    return 1;
+  }
+  size_t free_bytes = 0;
+  size_t largest = 0;
+  for (unsigned int i = 0; i < control->region_count_; i++) {
+    ControlHeader *region = reinterpret_cast<ControlHeader *>(
+        std::ptrdiff_t(mem) + i * control->region_size_);
+    RegionWalk walk;
+    WalkRegion(region, chunk, retries, cells, walk);
+    PrintRegion(int(i), region, walk, width);
+    free_bytes += walk.free_bytes_;
+    largest = Max(largest, walk.largest_free_);
+  }
+  printf("total free_bytes=%zu largest_free=%zu fragmentation=%.4f\n",
+         free_bytes, largest,
+         largest < free_bytes ? 1 - double(largest) / double(free_bytes)
+                              : 0.0);
+  shmdt(mem);
+}
@@ -0,0 +1,251 @@
+#include "vcalloc/trace.h"
+#include "vcalloc/vcalloc.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Replays recorded vcalloc traces (VCALLOC_TRACE_FILE) against vcalloc or
+// the system malloc. Records from every given file are merged by timestamp
+// and replayed from a single thread, each allocator in its own child
+// process so peak RSS is not shared between runs. Run with LD_PRELOAD to
+// measure another malloc implementation.
+
+const key_t kReplayKey = 0x76630200;
+const size_t kPageSize = 4096;
+
+struct Allocator {
+  const char *name_;
+  void *(*malloc_)(size_t size);
+  void (*free_)(void *ptr);
+  // Fragmentation as reported by the allocator, sampled during the replay
+  float (*fragmentation_)();
+};
+
+static vcalloc *replay_vcalloc = nullptr;
+
+static void *VcallocMalloc(size_t size) { return replay_vcalloc->Malloc(size); }
+static void VcallocFree(void *ptr) { replay_vcalloc->Free(ptr); }
+static float VcallocFragmentation() {
+  return replay_vcalloc->GetFragmentation();
+}
+
+static void *SystemMalloc(size_t size) { return malloc(size); }
+static void SystemFree(void *ptr) { free(ptr); }
+// Free bytes held inside the heap, glibc cannot report the largest block
+static float SystemFragmentation() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2();
+  if (!info.arena) {
+    return 0;
+  }
+  return float(info.fordblks) / float(info.arena);
+#else
+  return 0;
+#endif
+}
+
+static bool LoadTrace(const char *path, std::vector<TraceRecord> &records) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "%s: cannot open\n", path);
+    return false;
+  }
+  TraceFileHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic_, kTraceMagic, sizeof(header.magic_)) != 0 ||
+      header.version_ != kTraceVersion ||
+      header.record_size_ != sizeof(TraceRecord)) {
+    fprintf(stderr, "%s: not a vcalloc trace\n", path);
+    fclose(file);
+    return false;
+  }
+  TraceRecord record;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    records.push_back(record);
+  }
+  fclose(file);
+  return true;
+}
+
+static void Touch(void *ptr, size_t size) {
+  char *mem = static_cast<char *>(ptr);
+  memset(mem, 0xa5, Min(size, size_t(64)));
+  for (size_t offset = kPageSize; offset < size; offset += kPageSize) {
+    mem[offset] = 0;
+  }
+}
+
+static long MaxRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static void Replay(const Allocator &allocator,
+                   const std::vector<TraceRecord> &records) {
+  using std::chrono::steady_clock;
+
+  std::unordered_map<uint64_t, void *> live;
+  std::vector<uint64_t> latencies;
+  latencies.reserve(records.size());
+  live.reserve(records.size() / 2);
+
+  const long rss_before = MaxRssKb();
+  float max_fragmentation = 0;
+  size_t ops = 0;
+
+  auto start = steady_clock::now();
+  for (const TraceRecord &record : records) {
+    if (record.op_ == kTraceMalloc) {
+      auto it = live.find(record.offset_);
+      if (it != live.end()) {
+        // The matching free was not recorded
+        allocator.free_(it->second);
+        live.erase(it);
+      }
+      auto t1 = steady_clock::now();
+      void *ptr = allocator.malloc_(record.size_);
+      auto t2 = steady_clock::now();
+      latencies.push_back((t2 - t1).count());
+      Touch(ptr, record.size_);
+      live[record.offset_] = ptr;
+    } else {
+      auto it = live.find(record.offset_);
+      if (it == live.end()) {
+        // Allocated before tracing started
+        continue;
+      }
+      auto t1 = steady_clock::now();
+      allocator.free_(it->second);
+      auto t2 = steady_clock::now();
+      latencies.push_back((t2 - t1).count());
+      live.erase(it);
+    }
+    if (++ops % 4096 == 0) {
+      const float fragmentation = allocator.fragmentation_();
+      max_fragmentation = Max(max_fragmentation, fragmentation);
+    }
+  }
+  auto end = steady_clock::now();
+  const float fragmentation = allocator.fragmentation_();
+  max_fragmentation = Max(max_fragmentation, fragmentation);
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&latencies](double p) -> uint64_t {
+    if (latencies.empty()) {
+      return 0;
+    }
+    return latencies[size_t(p * (latencies.size() - 1))];
+  };
+  printf("allocator=%s ops=%zu ops_per_sec=%.0f p50_ns=%llu p90_ns=%llu "
+         "p99_ns=%llu p999_ns=%llu max_ns=%llu peak_rss_kb=%ld "
+         "frag=%.4f max_frag=%.4f\n",
+         allocator.name_, latencies.size(),
+         seconds > 0 ? latencies.size() / seconds : 0.0,
+         (unsigned long long)percentile(0.5),
+         (unsigned long long)percentile(0.9),
+         (unsigned long long)percentile(0.99),
+         (unsigned long long)percentile(0.999),
+         (unsigned long long)percentile(1.0), MaxRssKb() - rss_before,
+         fragmentation, max_fragmentation);
+  fflush(stdout);
+
+  for (auto &entry : live) {
+    allocator.free_(entry.second);
+  }
+}
+
+static void RemoveSegment() {
+  int shmid = shmget(kReplayKey, 0, 0);
+  if (shmid >= 0) {
+    shmctl(shmid, IPC_RMID, nullptr);
+  }
+}
+
+static void RunInChild(const Allocator &allocator, size_t pool_size,
+                       const std::vector<TraceRecord> &records) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return;
+  }
+  if (pid == 0) {
+    if (allocator.malloc_ == VcallocMalloc) {
+      vcalloc::Options options;
+      options.key = kReplayKey;
+      options.size = pool_size;
+      RemoveSegment();
+      replay_vcalloc = new vcalloc(options);
+      RemoveSegment();
+    }
+    Replay(allocator, records);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+static void Usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-s pool_size] vcalloc|malloc|all trace...\n"
+          "  frag is 1 - largest free / total free for vcalloc and\n"
+          "  free bytes held / heap size for malloc\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  size_t pool_size = 1024 * 1024 * 512;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if (opt == 's') {
+      pool_size = strtoull(optarg, nullptr, 0);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    Usage(argv[0]);
+    return 1;
+  }
+  const std::string which = argv[optind++];
+
+  std::vector<TraceRecord> records;
+  for (int i = optind; i < argc; i++) {
+    if (!LoadTrace(argv[i], records)) {
+      return 1;
+    }
+  }
+  std::stable_sort(records.begin(), records.end(),
+                   [](const TraceRecord &a, const TraceRecord &b) {
+                     return a.timestamp_ < b.timestamp_;
+                   });
+
+  const Allocator allocators[] = {
+      {"vcalloc", VcallocMalloc, VcallocFree, VcallocFragmentation},
+      {"malloc", SystemMalloc, SystemFree, SystemFragmentation},
+  };
+  bool matched = false;
+  for (const Allocator &allocator : allocators) {
+    if (which == "all" || which == allocator.name_) {
+      RunInChild(allocator, pool_size, records);
+      matched = true;
+    }
+  }
+  if (!matched) {
+    Usage(argv[0]);
+    return 1;
+  }
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "vcalloc/const.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Shared queue of MallocAsync requests waiting for memory
+
+enum AsyncState : uint32_t {
+  kAsyncFree = 0,
+  // Queued, waiting for a Free to release enough space
+  kAsyncWaiting = 1,
+  // A block has been reserved for the owner at offset_
+  kAsyncReady = 2,
+};
+
+typedef struct AsyncWaiter {
+  uint32_t state_;
+  // Owning process, its bridge thread signals the local eventfd
+  pid_t pid_;
+  // Arrival order, waiters are served strictly first come first served
+  uint64_t ticket_;
+  size_t size_;
+  size_t offset_;
+} AsyncWaiter;
+
+typedef struct WaitQueue {
+  pthread_mutex_t lock_;
+
+  // Number of kAsyncWaiting entries, read by Free without the lock
+  uint32_t waiting_;
+
+  // Futex word bumped whenever waiters have been served
+  uint32_t served_;
+
+  uint64_t next_ticket_;
+  AsyncWaiter waiters_[kMaxAsyncWaiters];
+
+  void Init() {
+    pthread_mutexattr_t lock_attr;
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&lock_, &lock_attr);
+
+    waiting_ = 0;
+    served_ = 0;
+    next_ticket_ = 0;
+    for (int i = 0; i < kMaxAsyncWaiters; i++) {
+      waiters_[i].state_ = kAsyncFree;
+    }
+  }
+
+  // Claim a slot for a new waiter, -1 if the queue is full
+  int Enqueue(pid_t pid, size_t size) {
+    for (int i = 0; i < kMaxAsyncWaiters; i++) {
+      AsyncWaiter &waiter = waiters_[i];
+      if (waiter.state_ == kAsyncFree) {
+        waiter.pid_ = pid;
+        waiter.ticket_ = next_ticket_++;
+        waiter.size_ = size;
+        waiter.state_ = kAsyncWaiting;
+        __atomic_add_fetch(&waiting_, 1, __ATOMIC_SEQ_CST);
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // The waiter that arrived first, nullptr if nobody is waiting
+  AsyncWaiter *Oldest() {
+    AsyncWaiter *oldest = nullptr;
+    for (int i = 0; i < kMaxAsyncWaiters; i++) {
+      AsyncWaiter &waiter = waiters_[i];
+      if (waiter.state_ == kAsyncWaiting &&
+          (!oldest || waiter.ticket_ < oldest->ticket_)) {
+        oldest = &waiter;
+      }
+    }
+    return oldest;
+  }
+
+  // Take a waiter off the waiting list, into state
+  void Leave(AsyncWaiter *waiter, AsyncState state) {
+    __atomic_store_n(&waiter->state_, state, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&waiting_, 1, __ATOMIC_SEQ_CST);
+  }
+} WaitQueue;
@@ -4,10 +4,26 @@
 #include "vcalloc/const.h"
 
 #include <assert.h>
+#include <cstring>
 #include <thread>
 
 constexpr size_t block_header_free_bit = 1 << 0;
 constexpr size_t block_header_prev_free_bit = 1 << 1;
+#if defined(VCALLOC_64BIT)
+// The payload is zero apart from a dirty prefix, the free list links, the
+// word recording the prefix length and the trailing word shared with the
+// next block's prev_phys_block_
+constexpr size_t block_header_zero_bit = 1 << 2;
+#else
+// 4-byte alignment leaves no spare bit, so memory is never known zero
+constexpr size_t block_header_zero_bit = 0;
+#endif
+constexpr size_t block_header_flag_bits =
+    block_header_free_bit | block_header_prev_free_bit | block_header_zero_bit;
+
+// Leading payload words a zero block uses for metadata: the two free list
+// links and its dirty prefix length
+constexpr size_t kZeroMetadataSize = 3 * sizeof(size_t);
 
 typedef struct BlockHeader {
   // Points to the previous physical block
@@ -34,13 +50,10 @@ typedef struct BlockHeader {
 
   static size_t MaxSize() { return size_t(1) << kFLIndexMax; }
 
-  size_t Size() const {
-    return size_ & ~(block_header_free_bit | block_header_prev_free_bit);
-  }
+  size_t Size() const { return size_ & ~block_header_flag_bits; }
 
   void SetSize(size_t new_size) {
-    size_ = new_size |
-            (size_ & (block_header_free_bit | block_header_prev_free_bit));
+    size_ = new_size | (size_ & block_header_flag_bits);
   }
 
   bool IsFree() const { return size_ & block_header_free_bit; }
@@ -55,6 +68,38 @@ typedef struct BlockHeader {
 
   void SetPrevUsed() { size_ &= ~block_header_prev_free_bit; }
 
+  bool IsZero() const { return size_ & block_header_zero_bit; }
+
+  /*
+  ** Mark the payload zero past its first dirty_prefix bytes. A block too
+  ** small to hold the prefix word next to its trailing word stays dirty.
+  */
+  void SetZero(size_t dirty_prefix) {
+    if (!block_header_zero_bit ||
+        Size() < kZeroMetadataSize + sizeof(size_t)) {
+      SetDirty();
+      return;
+    }
+    reinterpret_cast<size_t *>(ToPtr())[2] = dirty_prefix;
+    size_ |= block_header_zero_bit;
+  }
+
+  void SetDirty() { size_ &= ~block_header_zero_bit; }
+
+  // Payload bytes from the start that may be non-zero, zero blocks only
+  size_t DirtyPrefix() const {
+    return reinterpret_cast<const size_t *>(ToPtr())[2];
+  }
+
+  // Zero the first size bytes of a zero block's payload by clearing only
+  // its dirty prefix and the words that held allocator metadata
+  void ClearZeroBlock(size_t size) {
+    size_t *payload = reinterpret_cast<size_t *>(ToPtr());
+    const size_t prefix = Min(DirtyPrefix(), size);
+    memset(payload, 0, Max(prefix, kZeroMetadataSize));
+    payload[Size() / sizeof(size_t) - 1] = 0;
+  }
+
   bool IsLast() const { return Size() == 0; }
 
   void *ToPtr() const { return (void *)(std::ptrdiff_t(this) + StartOffset()); }
@@ -63,10 +108,12 @@ typedef struct BlockHeader {
     return reinterpret_cast<BlockHeader *>(std::ptrdiff_t(ptr) - StartOffset());
   }
 
+  // A block that is handed back is assumed to have been written to
   void MarkAsFree() {
     BlockHeader *next = LinkNext();
     next->SetPrevFree();
     SetFree();
+    SetDirty();
   }
 
   void MarkAsUsed() {
@@ -100,6 +147,9 @@ typedef struct BlockHeader {
 
   // Split a block into two, the second of which is free
   BlockHeader *Split(size_t size) {
+    // Read before the new header can overwrite the prefix word
+    const bool zero = IsZero();
+    const size_t prefix = zero ? DirtyPrefix() : 0;
     // Calculate the amount of space left in the remaining block
     BlockHeader *remaining = reinterpret_cast<BlockHeader *>(
         std::ptrdiff_t(ToPtr()) + size - sizeof(BlockHeader *));
@@ -112,12 +162,18 @@ typedef struct BlockHeader {
     assert(remaining->Size() >= MinSize() && "block split with invalid size");
     SetSize(size);
     remaining->MarkAsFree();
+    // The remaining payload starts size + Overhead() bytes into this one
+    if (zero) {
+      const size_t offset = size + Overhead();
+      remaining->SetZero(prefix > offset ? prefix - offset : 0);
+      SetZero(Min(prefix, size));
+    }
     return remaining;
   }
 
 } BlockHeader;
 
-static size_t AdjustRequestSize(size_t size) {
+inline static size_t AdjustRequestSize(size_t size) {
   if (VCCALLOC_unlikely(!size)) {
     return 0;
   }
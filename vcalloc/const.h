@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 /*
 ** Detect whether or not we are building for a 32- or 64-bit (LP/LLP)
@@ -26,6 +27,30 @@ constexpr int kFLIndexShift = (kSLIndexCountLog2 + kAlignSizeLog2);
 constexpr int kFLIndexCount = (kFLIndexMax - kFLIndexShift + 1);
 constexpr int kSmallBlockSize = (1 << kFLIndexShift);
 
+// Maximum number of list entries examined by the best-fit search policy
+constexpr int kBestFitSearchSteps = 8;
+
+// Free list entries compared per allocation by the address-ordered
+// policy and by large requests
+constexpr int kAddressSearchSteps = 8;
+
+// Regions a segment can be split into, one per NUMA node
+constexpr int kMaxNumaNodes = 8;
+// Allocations between refreshes of a thread's cached NUMA node
+constexpr int kNumaNodeRefresh = 1024;
+
+// Checked on attach, bump whenever ControlHeader or BlockHeader changes
+constexpr uint32_t kLayoutVersion = 3;
+
+// Processes a segment keeps track of to decide whether a heap is unused
+constexpr int kMaxAttachers = 256;
+
+// MallocAsync requests that can wait at the same time, across processes
+constexpr int kMaxAsyncWaiters = 64;
+
+// Pressure callbacks a process can register
+constexpr int kMaxPressureCallbacks = 8;
+
 static_assert(0 == (kAlignSize & (kAlignSize - 1)),
               "must align to a power of two");
 
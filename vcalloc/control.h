@@ -1,5 +1,6 @@
 #pragma once
 
+#include "vcalloc/async.h"
 #include "vcalloc/block.h"
 #include "vcalloc/common.h"
 
@@ -35,16 +36,82 @@ static void MappingSearch(size_t size, int *fli, int *sli) {
 
 const size_t NULL_OFFSET = std::numeric_limits<size_t>::max();
 
+enum SearchPolicy : unsigned int {
+  // Round the request up to the next class and take the first list head
+  kSearchGoodFit = 0,
+  // Scan the exact class list for the tightest block, then fall back
+  kSearchBestFit = 1,
+  // Take the lowest-addressed of the first few blocks in the chosen list
+  kSearchAddressOrdered = 2,
+};
+
+// Lifecycle of a segment, the low half of ControlHeader::init_word_
+enum InitState : uint32_t {
+  kInitNone = 0,
+  // Regions are being laid out by the process in the high half
+  kInitRunning = 1,
+  kInitDone = 2,
+};
+
+inline static uint64_t InitWord(pid_t pid, InitState state) {
+  return (uint64_t(uint32_t(pid)) << 32) | state;
+}
+
 typedef struct ControlHeader {
+  /*
+  ** Attach protocol, only the first region's fields are used. They stay
+  ** first so a process can check them before trusting anything else.
+  */
+  uint64_t init_word_;
+  uint32_t layout_version_;
+  uint32_t layout_size_;
+  // Serializes attaching with resetting a heap nobody else is attached
+  // to; robust so a process dying while holding it blocks nobody
+  pthread_mutex_t attach_lock_;
+  // Set while such a reset is in progress
+  uint32_t resetting_;
+  // Processes that attached, 0 for an unused entry. Once the table has
+  // overflowed the heap is never reset again.
+  pid_t attachers_[kMaxAttachers];
+  uint32_t attachers_overflow_;
+
   pthread_mutex_t mtx_;
   pthread_cond_t cond_;
 
   pthread_mutex_t lock_;
 
+  SearchPolicy search_policy_;
+
+  // Requests of at least this size are carved from the top of the pool
+  // downward, 0 disables the large-object path
+  size_t large_threshold_;
+
+  // NUMA node this region's pages are placed on, -1 if unbound
+  int node_;
+  // Segment layout, the same in every region
+  unsigned int region_count_;
+  size_t region_size_;
+
+  // MallocAsync waiters, only the first region's queue is used
+  WaitQueue wait_queue_;
+
+  // Bumped whenever a block header is absorbed, so a walker that dropped
+  // the lock can tell whether the block it stopped at may be gone
+  size_t generation_;
+
   // Statistic
 #if defined(VCALLOC_STATISTIC)
   size_t used_size_;
   size_t max_size_;
+
+  // Memory pressure of the whole segment, only the first region's fields
+  // are used. pressure_ is raised once used bytes reach high_watermark_
+  // and cleared once they fall below low_watermark_; every change bumps
+  // pressure_epoch_ so each process can notice it with a single load.
+  size_t high_watermark_;
+  size_t low_watermark_;
+  uint32_t pressure_;
+  uint32_t pressure_epoch_;
 #endif
 
   // Bitmaps for free lists
@@ -54,7 +121,8 @@ typedef struct ControlHeader {
   // Head of free lists
   size_t blocks_offset_[kFLIndexCount][kSLIndexCount];
 
-  void Init() {
+  void Init(SearchPolicy search_policy, size_t large_threshold, int node,
+            unsigned int region_count, size_t region_size) {
     pthread_mutexattr_t mutex_attr;
     pthread_mutexattr_init(&mutex_attr);
     pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
@@ -70,6 +138,22 @@ typedef struct ControlHeader {
     pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
     pthread_mutex_init(&lock_, &lock_attr);
 
+    search_policy_ = search_policy;
+    large_threshold_ = large_threshold;
+    node_ = node;
+    region_count_ = region_count;
+    region_size_ = region_size;
+
+    wait_queue_.Init();
+    generation_ = 0;
+
+#if defined(VCALLOC_STATISTIC)
+    high_watermark_ = 0;
+    low_watermark_ = 0;
+    pressure_ = 0;
+    pressure_epoch_ = 0;
+#endif
+
     fl_bitmap_ = 0;
     for (int i = 0; i < kFLIndexCount; i++) {
       sl_bitmap_[i] = 0;
@@ -79,7 +163,13 @@ typedef struct ControlHeader {
     }
   }
 
-  void InitPool(void *mem, size_t size) {
+  bool LayoutMatches() const {
+    return layout_version_ == kLayoutVersion &&
+           layout_size_ == sizeof(ControlHeader);
+  }
+
+  // zeroed tells whether the pool memory is known to be all zero
+  void InitPool(void *mem, size_t size, bool zeroed) {
     CheckMem(mem);
 
     BlockHeader *block;
@@ -112,6 +202,11 @@ typedef struct ControlHeader {
     block->SetSize(pool_size);
     block->SetFree();
     block->SetPrevUsed();
+    if (zeroed) {
+      block->SetZero(0);
+    } else {
+      block->SetDirty();
+    }
     InsertBlock(block);
 
     // Split the block to create a zero-size sentinel block
@@ -119,6 +214,7 @@ typedef struct ControlHeader {
     next->SetSize(0);
     next->SetUsed();
     next->SetPrevFree();
+    next->SetDirty();
 
 #if defined(VCALLOC_STATISTIC)
     used_size_ = BlockHeader::Overhead();
@@ -126,6 +222,13 @@ typedef struct ControlHeader {
 #endif
   }
 
+  // First block of the pool, walk on with Next() until IsLast()
+  BlockHeader *FirstBlock() {
+    return reinterpret_cast<BlockHeader *>(std::ptrdiff_t(this) +
+                                           sizeof(ControlHeader) -
+                                           BlockHeader::Overhead());
+  }
+
   BlockHeader* ApplyBlockOffset(size_t offset) {
     if (offset == NULL_OFFSET) {
       return nullptr;
@@ -196,13 +299,94 @@ typedef struct ControlHeader {
     return ApplyBlockOffset(blocks_offset_[fl][sl]);
   }
 
+  /*
+  ** Look for the tightest block in the list the request itself maps to.
+  ** Blocks there may be smaller than the request, which is why good-fit
+  ** skips this list; the scan is bounded so allocation stays O(1).
+  */
+  BlockHeader *SearchBestFitBlock(size_t size, int *fli, int *sli) {
+    int fl, sl;
+    MappingInsert(size, &fl, &sl);
+    if (fl >= kFLIndexCount || !(sl_bitmap_[fl] & (1U << sl))) {
+      return 0;
+    }
+    BlockHeader *best = 0;
+    BlockHeader *current = ApplyBlockOffset(blocks_offset_[fl][sl]);
+    for (int step = 0; current && step < kBestFitSearchSteps; step++) {
+      if (current->Size() >= size &&
+          (!best || current->Size() < best->Size())) {
+        best = current;
+        if (best->Size() == size) {
+          break;
+        }
+      }
+      current = ApplyBlockOffset(current->next_free_);
+    }
+    *fli = fl;
+    *sli = sl;
+    return best;
+  }
+
+  /*
+  ** The lowest-addressed block among the first kAddressSearchSteps of a
+  ** list. Lists are not kept sorted, inserting stays O(1), so this only
+  ** biases allocation towards the bottom of the pool.
+  */
+  BlockHeader *SearchLowestBlock(BlockHeader *head) {
+    BlockHeader *lowest = head;
+    BlockHeader *current = ApplyBlockOffset(head->next_free_);
+    for (int step = 1; current && step < kAddressSearchSteps; step++) {
+      if (current < lowest) {
+        lowest = current;
+      }
+      current = ApplyBlockOffset(current->next_free_);
+    }
+    return lowest;
+  }
+
+  /*
+  ** Large requests skip good-fit, which would hand them the smallest list
+  ** that fits and so a hole between small objects. They take the highest
+  ** suitable block among the first entries of the largest list instead,
+  ** normally the gap between the bottom and top parts of the pool.
+  */
+  BlockHeader *SearchLargeBlock(size_t size, int *fli, int *sli) {
+    if (!fl_bitmap_) {
+      return 0;
+    }
+    const int fl = vcalloc_fls(fl_bitmap_);
+    const int sl = vcalloc_fls(sl_bitmap_[fl]);
+    BlockHeader *highest = 0;
+    BlockHeader *current = ApplyBlockOffset(blocks_offset_[fl][sl]);
+    for (int step = 0; current && step < kAddressSearchSteps; step++) {
+      if (current->Size() >= size && current > highest) {
+        highest = current;
+      }
+      current = ApplyBlockOffset(current->next_free_);
+    }
+    *fli = fl;
+    *sli = sl;
+    return highest;
+  }
+
   BlockHeader *LocateFreeBlock(size_t size) {
     int fl = 0, sl = 0;
     BlockHeader *block = 0;
     if (size) {
-      MappingSearch(size, &fl, &sl);
-      if (fl < kFLIndexCount) {
-        block = SearchSuitableBlock(&fl, &sl);
+      if (large_threshold_ && size >= large_threshold_) {
+        block = SearchLargeBlock(size, &fl, &sl);
+      } else if (search_policy_ == kSearchBestFit) {
+        block = SearchBestFitBlock(size, &fl, &sl);
+      }
+      if (!block) {
+        MappingSearch(size, &fl, &sl);
+        if (fl < kFLIndexCount) {
+          block = SearchSuitableBlock(&fl, &sl);
+        }
+        // Every block in a list found by good-fit is large enough
+        if (block && search_policy_ == kSearchAddressOrdered) {
+          block = SearchLowestBlock(block);
+        }
       }
     }
     if (block) {
@@ -248,7 +432,11 @@ typedef struct ControlHeader {
       return 0;
     }
     assert(size && "size must be non-zero");
-    BlockTrimFree(block, size);
+    if (large_threshold_ && size >= large_threshold_) {
+      block = BlockTrimFreeLeading(block, size);
+    } else {
+      BlockTrimFree(block, size);
+    }
     block->MarkAsUsed();
     return block->ToPtr();
   }
@@ -265,6 +453,40 @@ typedef struct ControlHeader {
     InsertBlock(remaining_block);
   }
 
+  // Size of the largest free block, or 0 if the pool is exhausted
+  size_t LargestFreeSize() {
+    if (!fl_bitmap_) {
+      return 0;
+    }
+    const int fl = vcalloc_fls(fl_bitmap_);
+    const int sl = vcalloc_fls(sl_bitmap_[fl]);
+    size_t largest = 0;
+    BlockHeader *current = ApplyBlockOffset(blocks_offset_[fl][sl]);
+    while (current) {
+      largest = Max(largest, current->Size());
+      current = ApplyBlockOffset(current->next_free_);
+    }
+    return largest;
+  }
+
+  /*
+  ** Trim any leading block space off the front of a block, return it to
+  ** the pool and hand out the tail. Large objects therefore grow down from
+  ** the end of the pool while small ones are split off the front.
+  */
+  BlockHeader *BlockTrimFreeLeading(BlockHeader *block, size_t size) {
+    assert(block->IsFree() && "block must be free");
+    if (!block->CanSplit(size)) {
+      return block;
+    }
+    BlockHeader *remaining_block =
+        block->Split(block->Size() - (size + BlockHeader::Overhead()));
+    remaining_block->SetPrevFree();
+    block->LinkNext();
+    InsertBlock(block);
+    return remaining_block;
+  }
+
   // Merge a just-freed block with an adjacent previous free block
   BlockHeader *MergePrevBlock(BlockHeader *block) {
     if (!block->IsPrevFree()) {
@@ -300,9 +522,25 @@ typedef struct ControlHeader {
   // Absorb a free block's storage into an adjacent previous free block
   BlockHeader *AbsorbBlock(BlockHeader *prev, BlockHeader *block) {
     assert(!prev->IsLast() && "previous block can't be last");
+    generation_++;
+    /*
+    ** Only a zero tail survives a merge: everything up to the end of the
+    ** absorbed block's own dirty prefix and metadata becomes the merged
+    ** block's dirty prefix. Nothing is cleared here; Calloc clears the
+    ** prefix if it ever hands the block out.
+    */
+    const bool zero = block->IsZero();
+    const size_t prefix =
+        prev->Size() + BlockHeader::Overhead() +
+        Max(zero ? block->DirtyPrefix() : 0, kZeroMetadataSize);
     // Note: Leaves flags untouched
     prev->size_ += block->Size() + BlockHeader::Overhead();
     prev->LinkNext();
+    if (zero) {
+      prev->SetZero(prefix);
+    } else {
+      prev->SetDirty();
+    }
     return prev;
   }
 
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "vcalloc/const.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Sampling heap profiler, compiled in with VCALLOC_PROFILE
+
+constexpr int kProfileMaxDepth = 32;
+
+// Live samples are kept in buckets of one cache line of keys each, so a
+// Free of an unsampled pointer costs a single line of loads
+constexpr int kProfileBucketSlotsLog2 = 3;
+constexpr int kProfileBucketSlots = (1 << kProfileBucketSlotsLog2);
+constexpr int kProfileBucketCount = 2048;
+constexpr int kProfileSlotCount = kProfileBucketCount * kProfileBucketSlots;
+
+// Key of a slot that is claimed but not yet published
+constexpr uintptr_t kProfileSlotClaimed = 1;
+
+typedef struct ProfileSample {
+  // Requested size of the sampled allocation
+  size_t size_;
+  // Mean sampling interval when the sample was taken
+  size_t rate_;
+  // Block size when sampled, to tell whether the block is still live
+  size_t block_size_;
+  int depth_;
+  void *stack_[kProfileMaxDepth];
+} ProfileSample;
+
+typedef struct ProfileTable {
+  alignas(64) std::atomic<uintptr_t> keys_[kProfileSlotCount];
+  ProfileSample samples_[kProfileSlotCount];
+  std::atomic<size_t> live_;
+
+  static int Bucket(uintptr_t ptr) {
+    const uintptr_t hash = (ptr >> kAlignSizeLog2) * 0x9e3779b97f4a7c15ULL;
+    return int((hash >> 32) % kProfileBucketCount);
+  }
+
+  // Claim a free slot for ptr, returns nullptr if its bucket is full
+  ProfileSample *Claim(uintptr_t ptr, std::atomic<uintptr_t> **key) {
+    const int base = Bucket(ptr) * kProfileBucketSlots;
+    for (int i = 0; i < kProfileBucketSlots; i++) {
+      uintptr_t expected = 0;
+      if (keys_[base + i].compare_exchange_strong(expected,
+                                                  kProfileSlotClaimed)) {
+        *key = &keys_[base + i];
+        return &samples_[base + i];
+      }
+    }
+    return nullptr;
+  }
+
+  void Publish(std::atomic<uintptr_t> *key, uintptr_t ptr) {
+    live_.fetch_add(1, std::memory_order_relaxed);
+    key->store(ptr, std::memory_order_release);
+  }
+
+  // Drop the sample in slot if it still belongs to key
+  void Drop(int slot, uintptr_t key) {
+    if (keys_[slot].compare_exchange_strong(key, 0)) {
+      live_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Drop the sample for ptr if there is one
+  void Remove(uintptr_t ptr) {
+    if (!live_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    const int base = Bucket(ptr) * kProfileBucketSlots;
+    for (int i = 0; i < kProfileBucketSlots; i++) {
+      uintptr_t expected = ptr;
+      if (keys_[base + i].load(std::memory_order_relaxed) == ptr &&
+          keys_[base + i].compare_exchange_strong(expected, 0)) {
+        live_.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+  }
+} ProfileTable;
+
+#if defined(VCALLOC_PROFILE)
+// Sample roughly one allocation per rate bytes, 0 disables sampling. A
+// non-zero signal number requests a dump to path when it is delivered.
+void ProfileInit(size_t rate, int signal, const char *path);
+// Write live samples as collapsed stacks weighted by estimated bytes
+bool ProfileDump(const char *path);
+#endif
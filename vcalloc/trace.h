@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Allocation trace format shared by the recorder and vcalloc-replay
+
+enum TraceOp : uint32_t {
+  kTraceMalloc = 0,
+  kTraceFree = 1,
+};
+
+constexpr char kTraceMagic[8] = {'V', 'C', 'T', 'R', 'A', 'C', 'E', 0};
+constexpr uint32_t kTraceVersion = 1;
+
+// Records buffered per thread before they are written out
+constexpr size_t kTraceBufferRecords = 4096;
+
+// Written once at the start of every trace file
+typedef struct TraceFileHeader {
+  char magic_[8];
+  uint32_t version_;
+  uint32_t record_size_;
+} TraceFileHeader;
+
+typedef struct TraceRecord {
+  // CLOCK_MONOTONIC in nanoseconds, comparable across processes
+  uint64_t timestamp_;
+  // Kernel thread id of the caller
+  uint32_t thread_;
+  uint32_t op_;
+  // Requested size for Malloc, 0 for Free
+  uint64_t size_;
+  // Block offset within the segment, identifies the allocation
+  uint64_t offset_;
+} TraceRecord;
+
+static_assert(sizeof(TraceRecord) == 32, "trace records must stay packed");
+
+#if defined(VCALLOC_TRACE)
+// Start tracing to <path>.<pid>; does nothing if already tracing
+void TraceOpen(const char *path);
+void TraceRecordOp(TraceOp op, size_t size, size_t offset);
+// Write the calling thread's buffered records
+void TraceFlush();
+#endif
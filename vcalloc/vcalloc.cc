@@ -1,114 +1,1281 @@
 #include "vcalloc/vcalloc.h"
 #include "vcalloc/block.h"
 #include "vcalloc/common.h"
+#include "vcalloc/profile.h"
+#include "vcalloc/trace.h"
 
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sstream>
+#include <string>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
 #include <thread>
+#include <time.h>
+#include <unistd.h>
 
 vcalloc &Global::GetAllocator() {
   static vcalloc allocator;
   return allocator;
 }
 
-void GetKeyAndSize(key_t &key, size_t &size) {
+#if defined(VCALLOC_TRACE)
+static std::mutex trace_mutex;
+static int trace_fd = -1;
+// Fixed buffers, TraceOpen runs inside the allocator's own constructor
+static char trace_path[PATH_MAX];
+
+struct TraceBuffer {
+  TraceRecord *records_ = nullptr;
+  size_t count_ = 0;
+  uint32_t thread_ = 0;
+
+  ~TraceBuffer() {
+    Flush();
+    if (records_) {
+      munmap(records_, kTraceBufferRecords * sizeof(TraceRecord));
+      records_ = nullptr;
+    }
+  }
+
+  void Flush() {
+    const char *data = reinterpret_cast<const char *>(records_);
+    size_t remain = count_ * sizeof(TraceRecord);
+    count_ = 0;
+    while (remain && trace_fd >= 0) {
+      ssize_t written = write(trace_fd, data, remain);
+      if (written <= 0) {
+        break;
+      }
+      data += written;
+      remain -= written;
+    }
+  }
+};
+
+// Mapped lazily so idle threads do not pay for a buffer
+static thread_local TraceBuffer trace_buffer;
+
+static void TraceOpenFile() {
+  char file[PATH_MAX];
+  if (snprintf(file, sizeof(file), "%s.%d", trace_path, int(getpid())) >=
+      int(sizeof(file))) {
+    return;
+  }
+  trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (trace_fd < 0) {
+    return;
+  }
+  TraceFileHeader header;
+  memcpy(header.magic_, kTraceMagic, sizeof(header.magic_));
+  header.version_ = kTraceVersion;
+  header.record_size_ = sizeof(TraceRecord);
+  if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) {
+    close(trace_fd);
+    trace_fd = -1;
+  }
+}
+
+// The child gets its own file and drops the parent's buffered records
+static void TraceAtForkChild() {
+  trace_buffer.count_ = 0;
+  trace_buffer.thread_ = 0;
+  if (trace_fd >= 0) {
+    close(trace_fd);
+    TraceOpenFile();
+  }
+}
+
+void TraceOpen(const char *path) {
+  std::lock_guard<std::mutex> guard(trace_mutex);
+  if (trace_fd >= 0) {
+    return;
+  }
+  snprintf(trace_path, sizeof(trace_path), "%s", path);
+  TraceOpenFile();
+  static bool registered = false;
+  if (!registered) {
+    pthread_atfork(nullptr, nullptr, TraceAtForkChild);
+    registered = true;
+  }
+}
+
+void TraceRecordOp(TraceOp op, size_t size, size_t offset) {
+  if (trace_fd < 0) {
+    return;
+  }
+  TraceBuffer &buffer = trace_buffer;
+  if (VCCALLOC_unlikely(!buffer.records_)) {
+    void *mem = mmap(nullptr, kTraceBufferRecords * sizeof(TraceRecord),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                     0);
+    if (mem == MAP_FAILED) {
+      return;
+    }
+    buffer.records_ = reinterpret_cast<TraceRecord *>(mem);
+  }
+  if (VCCALLOC_unlikely(!buffer.thread_)) {
+    buffer.thread_ = (uint32_t)syscall(SYS_gettid);
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  TraceRecord &record = buffer.records_[buffer.count_++];
+  record.timestamp_ = uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+  record.thread_ = buffer.thread_;
+  record.op_ = op;
+  record.size_ = size;
+  record.offset_ = offset;
+  if (buffer.count_ == kTraceBufferRecords) {
+    buffer.Flush();
+  }
+}
+
+void TraceFlush() { trace_buffer.Flush(); }
+#endif
+
+#if defined(VCALLOC_PROFILE)
+// Countdown used while sampling is off, so threads recheck only rarely
+constexpr int64_t kProfileIdleCountdown = int64_t(1) << 40;
+// Frames belonging to ProfileSampleSlow and vcalloc::AllocateBlock
+constexpr int kProfileSkipFrames = 2;
+
+static ProfileTable *profile_table = nullptr;
+static size_t profile_rate = 0;
+// Fixed, ProfileInit runs inside the allocator's own constructor
+static char profile_path[PATH_MAX];
+static std::atomic<bool> profile_dump_requested(false);
+static std::atomic<int> profile_dump_sequence(0);
+static std::mutex profile_dump_mutex;
+
+static thread_local int64_t profile_countdown = 0;
+static thread_local uint64_t profile_rng = 0;
+static thread_local bool profile_busy = false;
+
+static void ProfileSignalHandler(int) {
+  profile_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+// Exponentially distributed bytes until the next sample, mean profile_rate
+static int64_t ProfileNextInterval() {
+  if (VCCALLOC_unlikely(!profile_rng)) {
+    profile_rng = uint64_t(syscall(SYS_gettid)) * 0x9e3779b97f4a7c15ULL | 1;
+  }
+  profile_rng ^= profile_rng >> 12;
+  profile_rng ^= profile_rng << 25;
+  profile_rng ^= profile_rng >> 27;
+  const double u =
+      double((profile_rng * 0x2545f4914f6cdd1dULL) >> 11) /
+      9007199254740992.0;
+  const double interval = -std::log(1.0 - u) * double(profile_rate);
+  return Max(int64_t(interval), int64_t(1));
+}
+
+void ProfileInit(size_t rate, int signal, const char *path) {
+  std::lock_guard<std::mutex> guard(profile_dump_mutex);
+  if (profile_table || !rate) {
+    return;
+  }
+  void *mem = mmap(nullptr, sizeof(ProfileTable), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return;
+  }
+  // Load the unwinder now rather than inside the first sample
+  void *frame;
+  backtrace(&frame, 1);
+
+  snprintf(profile_path, sizeof(profile_path), "%s", path);
+  profile_table = reinterpret_cast<ProfileTable *>(mem);
+  if (signal) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = ProfileSignalHandler;
+    action.sa_flags = SA_RESTART;
+    sigaction(signal, &action, nullptr);
+  }
+  profile_rate = rate;
+}
+
+/*
+** The heap is shared, so a block sampled here may be freed by another
+** process, which never sees this table. A sample is dropped once its
+** header no longer shows a used block of the sampled size. A block that
+** was reused at the same size keeps the old stack, the check is only
+** best effort.
+*/
+static bool ProfileSampleLive(uintptr_t key, const ProfileSample &sample) {
+  const BlockHeader *block =
+      BlockHeader::FromPtr(reinterpret_cast<void *>(key));
+  return !block->IsFree() && block->Size() == sample.block_size_;
+}
+
+static void ProfileReap(int first, int count) {
+  for (int i = first; i < first + count; i++) {
+    const uintptr_t key =
+        profile_table->keys_[i].load(std::memory_order_acquire);
+    if (key != 0 && key != kProfileSlotClaimed &&
+        !ProfileSampleLive(key, profile_table->samples_[i])) {
+      profile_table->Drop(i, key);
+    }
+  }
+}
+
+__attribute__((noinline)) static void ProfileSampleSlow(void *ptr,
+                                                        size_t size) {
+  if (!profile_rate) {
+    profile_countdown = kProfileIdleCountdown;
+    return;
+  }
+  // A thread's first allocation only arms its countdown
+  const bool armed = profile_rng != 0;
+  profile_countdown = ProfileNextInterval();
+  if (!armed || profile_busy) {
+    return;
+  }
+  profile_busy = true;
+  if (profile_dump_requested.exchange(false, std::memory_order_relaxed)) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s.%d.%d", profile_path, int(getpid()),
+                 profile_dump_sequence++) < int(sizeof(path))) {
+      ProfileDump(path);
+    }
+  }
+  std::atomic<uintptr_t> *key;
+  ProfileSample *sample = profile_table->Claim(uintptr_t(ptr), &key);
+  if (!sample) {
+    // The bucket may be full of blocks other processes have freed
+    ProfileReap(ProfileTable::Bucket(uintptr_t(ptr)) * kProfileBucketSlots,
+                kProfileBucketSlots);
+    sample = profile_table->Claim(uintptr_t(ptr), &key);
+  }
+  if (sample) {
+    void *stack[kProfileMaxDepth + kProfileSkipFrames];
+    const int depth = backtrace(stack, kProfileMaxDepth + kProfileSkipFrames);
+    sample->size_ = size;
+    sample->rate_ = profile_rate;
+    sample->block_size_ = BlockHeader::FromPtr(ptr)->Size();
+    sample->depth_ = Max(depth - kProfileSkipFrames, 0);
+    memcpy(sample->stack_, stack + kProfileSkipFrames,
+           sample->depth_ * sizeof(void *));
+    profile_table->Publish(key, uintptr_t(ptr));
+  }
+  profile_busy = false;
+}
+
+__attribute__((always_inline)) inline static void ProfileMalloc(void *ptr,
+                                                                size_t size) {
+  profile_countdown -= int64_t(size);
+  if (VCCALLOC_likely(profile_countdown > 0)) {
+    return;
+  }
+  ProfileSampleSlow(ptr, size);
+}
+
+inline static void ProfileFree(void *ptr) {
+  if (profile_table) {
+    profile_table->Remove(uintptr_t(ptr));
+  }
+}
+
+static void ProfileWriteFrame(FILE *file, void *address) {
+  Dl_info info;
+  if (!dladdr(address, &info)) {
+    fprintf(file, "%p", address);
+  } else if (info.dli_sname) {
+    int status;
+    char *name = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    fputs(status == 0 ? name : info.dli_sname, file);
+    free(name);
+  } else {
+    fprintf(file, "%s+0x%zx", info.dli_fname,
+            size_t(address) - size_t(info.dli_fbase));
+  }
+}
+
+/*
+** Each live sample becomes one "root;...;leaf bytes" line. A sample stands
+** for size / (1 - exp(-size / rate)) bytes, the expected amount allocated
+** per sample taken at that size.
+*/
+bool ProfileDump(const char *path) {
+  if (!profile_table) {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(profile_dump_mutex);
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return false;
+  }
+  const bool busy = profile_busy;
+  profile_busy = true;
+  ProfileReap(0, kProfileSlotCount);
+  for (int i = 0; i < kProfileSlotCount; i++) {
+    const uintptr_t key =
+        profile_table->keys_[i].load(std::memory_order_acquire);
+    if (key == 0 || key == kProfileSlotClaimed) {
+      continue;
+    }
+    const ProfileSample &sample = profile_table->samples_[i];
+    const double ratio = double(sample.size_) / double(sample.rate_);
+    const double bytes = double(sample.size_) / (1 - std::exp(-ratio));
+    for (int depth = sample.depth_ - 1; depth >= 0; depth--) {
+      ProfileWriteFrame(file, sample.stack_[depth]);
+      if (depth) {
+        fputc(';', file);
+      }
+    }
+    fprintf(file, " %llu\n", (unsigned long long)bytes);
+  }
+  profile_busy = busy;
+  return fclose(file) == 0;
+}
+#endif
+
+void GetOptions(vcalloc::Options &options) {
   const char *mem_name = std::getenv("VCALLOC_MEM_NAME");
   const char *mem_size = std::getenv("VCALLOC_MEM_SIZE");
+  const char *search_policy = std::getenv("VCALLOC_SEARCH_POLICY");
+  const char *large_threshold = std::getenv("VCALLOC_LARGE_THRESHOLD");
+  const char *numa = std::getenv("VCALLOC_NUMA");
+  const char *high_watermark = std::getenv("VCALLOC_HIGH_WATERMARK");
+  const char *low_watermark = std::getenv("VCALLOC_LOW_WATERMARK");
   if (mem_name) {
     std::stringstream s_mem_name(mem_name);
-    s_mem_name >> key;
-  } else {
-    key = 12345;
+    s_mem_name >> options.key;
   }
   if (mem_size) {
     std::stringstream s_mem_size(mem_size);
-    s_mem_size >> size;
-  } else {
-    size = 1024 * 1024 * 512;
+    s_mem_size >> options.size;
+  }
+  // Compared in place, this runs inside the global allocator's own
+  // constructor where operator new must not be called
+  if (search_policy) {
+    if (strcmp(search_policy, "best") == 0) {
+      options.search_policy = kSearchBestFit;
+    } else if (strcmp(search_policy, "address") == 0) {
+      options.search_policy = kSearchAddressOrdered;
+    } else {
+      options.search_policy = kSearchGoodFit;
+    }
+  }
+  if (large_threshold) {
+    options.large_threshold = size_t(strtoull(large_threshold, nullptr, 10));
+  }
+  if (numa) {
+    options.numa = strcmp(numa, "1") == 0;
+  }
+  if (high_watermark) {
+    options.high_watermark = unsigned(strtoul(high_watermark, nullptr, 10));
+  }
+  if (low_watermark) {
+    options.low_watermark = unsigned(strtoul(low_watermark, nullptr, 10));
   }
 }
 
-vcalloc::vcalloc() {
-  key_t key;
-  size_t size;
-  GetKeyAndSize(key, size);
+/*
+** Online NUMA nodes, e.g. "0-1,3" in sysfs; at most kMaxNumaNodes. Read
+** into a stack buffer, this runs inside the global allocator's own
+** constructor where operator new must not be called.
+*/
+static int GetNumaNodes(int *nodes) {
+  char buffer[256];
+  const int fd = open("/sys/devices/system/node/online", O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  const ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (length <= 0) {
+    return 0;
+  }
+  buffer[length] = 0;
 
-  int shmid = shmget(key, size, IPC_CREAT | 0666);
-  if (shmid < 0) {
-    exit(1);
+  int count = 0;
+  char *cursor = buffer;
+  while (count < kMaxNumaNodes) {
+    char *end;
+    const long first = strtol(cursor, &end, 10);
+    if (end == cursor) {
+      break;
+    }
+    long last = first;
+    cursor = end;
+    if (*cursor == '-') {
+      last = strtol(cursor + 1, &end, 10);
+      cursor = end;
+    }
+    for (long node = first; node <= last && count < kMaxNumaNodes; node++) {
+      nodes[count++] = int(node);
+    }
+    if (*cursor != ',') {
+      break;
+    }
+    cursor++;
   }
-  struct shmid_ds shminfo;
-  if (shmctl(shmid, IPC_STAT, &shminfo) == -1) {
+  return count;
+}
+
+/*
+** Prefer rather than strictly bind, so the kernel may still place pages
+** elsewhere when the node is short of memory instead of failing the fault.
+** Errors (no NUMA support, no permission) leave the default policy.
+*/
+static void BindToNode(void *mem, size_t size, int node) {
+  if (node < 0 || node >= int(sizeof(unsigned long) * 8)) {
+    return;
+  }
+  unsigned long mask = 1UL << node;
+  syscall(SYS_mbind, mem, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+// NUMA node of the calling thread, re-read every kNumaNodeRefresh calls
+static int CurrentNode() {
+  static thread_local int node = -1;
+  static thread_local int calls = 0;
+  if (VCCALLOC_unlikely(calls-- <= 0)) {
+    unsigned int cpu, current;
+    if (syscall(SYS_getcpu, &cpu, &current, nullptr) == 0) {
+      node = int(current);
+    }
+    calls = kNumaNodeRefresh;
+  }
+  return node;
+}
+
+static vcalloc::Options EnvOptions() {
+  vcalloc::Options options;
+  GetOptions(options);
+  return options;
+}
+
+vcalloc::vcalloc() : vcalloc(EnvOptions()) {}
+
+// Lay out one region per NUMA node, or a single one, over the segment
+static void InitRegions(ControlHeader *control,
+                        const vcalloc::Options &options, bool zeroed) {
+  const std::ptrdiff_t control_mem = std::ptrdiff_t(control);
+  int nodes[kMaxNumaNodes];
+  const int node_count = options.numa ? GetNumaNodes(nodes) : 0;
+  // A single node machine keeps the whole segment as one region
+  const unsigned int region_count = Max(node_count, 1);
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t region_size = region_count > 1
+                                 ? (options.size / region_count) &
+                                       ~(page_size - 1)
+                                 : options.size;
+  for (unsigned int i = 0; i < region_count; i++) {
+    std::ptrdiff_t region_mem = control_mem + i * region_size;
+    ControlHeader *region = reinterpret_cast<ControlHeader *>(region_mem);
+    const int node = region_count > 1 ? nodes[i] : -1;
+    // Set the policy before anything in the region is touched
+    BindToNode(region, region_size, node);
+    region->Init(options.search_policy, options.large_threshold, node,
+                 region_count, region_size);
+    region->InitPool((void *)(region_mem + sizeof(ControlHeader)),
+                     region_size - sizeof(ControlHeader), zeroed);
+  }
+#if defined(VCALLOC_STATISTIC)
+  size_t max_size = 0;
+  for (unsigned int i = 0; i < region_count; i++) {
+    max_size +=
+        reinterpret_cast<ControlHeader *>(control_mem + i * region_size)
+            ->max_size_;
+  }
+  const unsigned int high = Min(options.high_watermark, 100U);
+  const unsigned int low =
+      options.low_watermark ? Min(options.low_watermark, high) : high;
+  control->high_watermark_ = max_size / 100 * high;
+  control->low_watermark_ = max_size / 100 * low;
+#endif
+}
+
+// First initialization, the caller owns init_word_ in kInitRunning
+static void InitSegment(ControlHeader *control,
+                        const vcalloc::Options &options, bool zeroed) {
+  control->layout_version_ = kLayoutVersion;
+  control->layout_size_ = sizeof(ControlHeader);
+
+  pthread_mutexattr_t attach_attr;
+  pthread_mutexattr_init(&attach_attr);
+  pthread_mutexattr_setpshared(&attach_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attach_attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&control->attach_lock_, &attach_attr);
+  control->resetting_ = 0;
+  for (int i = 0; i < kMaxAttachers; i++) {
+    control->attachers_[i] = 0;
+  }
+  control->attachers_[0] = getpid();
+  control->attachers_overflow_ = 0;
+
+  InitRegions(control, options, zeroed);
+  __atomic_store_n(&control->init_word_, InitWord(getpid(), kInitDone),
+                   __ATOMIC_RELEASE);
+}
+
+static bool ProcessAlive(pid_t pid) {
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+** Forget attachers that have exited and record self, under attach_lock_.
+** Returns whether any other process may still be using the heap. A
+** recycled pid only ever prevents a reset, and all processes sharing a
+** segment are assumed to share a pid namespace. A process that is the
+** only one mapping the segment starts the table afresh.
+*/
+static bool RegisterAttacher(ControlHeader *control, pid_t self,
+                             bool alone) {
+  if (alone) {
+    for (int i = 0; i < kMaxAttachers; i++) {
+      control->attachers_[i] = 0;
+    }
+    control->attachers_overflow_ = 0;
+  }
+  bool shared = control->attachers_overflow_ != 0;
+  int unused = -1;
+  bool registered = false;
+  for (int i = 0; i < kMaxAttachers; i++) {
+    const pid_t pid = control->attachers_[i];
+    if (pid && pid != self && !ProcessAlive(pid)) {
+      control->attachers_[i] = 0;
+    } else if (pid == self) {
+      // Another instance in this process
+      shared = true;
+      registered = true;
+    } else if (pid) {
+      shared = true;
+    }
+    if (!control->attachers_[i] && unused < 0) {
+      unused = i;
+    }
+  }
+  if (!registered) {
+    if (unused >= 0) {
+      control->attachers_[unused] = self;
+    } else {
+      control->attachers_overflow_ = 1;
+    }
+  }
+  return shared;
+}
+
+/*
+** Exactly one process initializes a segment: the one that moves
+** init_word_ out of kInitNone, or the one that takes over from an
+** initializer that died. Everyone else waits for kInitDone. Attaching to
+** an initialized segment only touches the first region's header, unless
+** this process is the only one mapping the segment or every process
+** recorded as attached has exited, in which case the heap is reset like
+** the segment was new. Returns false for a segment laid out by another
+** version.
+*/
+static bool AttachSegment(int shmid, ControlHeader *control,
+                          const vcalloc::Options &options, bool created) {
+  const pid_t self = getpid();
+  for (unsigned int spins = 0;; spins++) {
+    uint64_t word = __atomic_load_n(&control->init_word_, __ATOMIC_ACQUIRE);
+    const InitState state = InitState(word & 0xffffffff);
+    if (state == kInitNone || state == kInitRunning) {
+      const pid_t owner = pid_t(word >> 32);
+      // Memory a dead initializer touched is no longer known zero
+      const bool zeroed = state == kInitNone && created;
+      if ((state == kInitNone || !ProcessAlive(owner)) &&
+          __atomic_compare_exchange_n(&control->init_word_, &word,
+                                      InitWord(self, kInitRunning), false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        InitSegment(control, options, zeroed);
+        return true;
+      }
+      if (spins < 64) {
+        sched_yield();
+      } else {
+        usleep(100);
+      }
+      continue;
+    }
+
+    if (state != kInitDone || !control->LayoutMatches()) {
+      return false;
+    }
+
+    // A dead holder may have been resetting, resetting_ tells
+    if (pthread_mutex_lock(&control->attach_lock_) == EOWNERDEAD) {
+      pthread_mutex_consistent(&control->attach_lock_);
+    }
+    // Every other attacher is either recorded or mapped and waiting on the
+    // lock, so nobody can be using a heap that is only mapped here or that
+    // no live process is recorded for. Processes that exec'd detached.
+    struct shmid_ds shminfo;
+    const bool alone =
+        shmctl(shmid, IPC_STAT, &shminfo) == 0 && shminfo.shm_nattch == 1;
+    const bool shared = RegisterAttacher(control, self, alone);
+    if (control->resetting_ || !shared) {
+      control->resetting_ = 1;
+      InitRegions(control, options, false);
+      control->resetting_ = 0;
+    }
+    pthread_mutex_unlock(&control->attach_lock_);
+    return true;
+  }
+}
+
+/*
+** Instances of this process, for the fork handlers. A forked child
+** inherits the async state but neither the bridge thread nor the queue
+** slots, which still belong to the parent, so every instance is reset in
+** the child. The child also keeps using the heap after its parent exits
+** and records itself as an attacher.
+*/
+static std::mutex instances_mutex;
+static vcalloc *instances = nullptr;
+
+void vcalloc::AtForkPrepare() { instances_mutex.lock(); }
+
+void vcalloc::AtForkParent() { instances_mutex.unlock(); }
+
+void vcalloc::AtForkChild() {
+  for (vcalloc *instance = instances; instance;
+       instance = instance->next_instance_) {
+    // Another thread of the parent may have held it during fork
+    new (&instance->async_mutex_) std::mutex();
+    for (int i = 0; i < kMaxAsyncWaiters; i++) {
+      if (instance->async_fds_[i] >= 0) {
+        close(instance->async_fds_[i]);
+        instance->async_fds_[i] = -1;
+      }
+      instance->async_signalled_[i] = false;
+    }
+    instance->async_bridge_started_ = false;
+
+    // No thread of the parent held it, see the constructor
+    ControlHeader *control = instance->control_;
+    if (pthread_mutex_lock(&control->attach_lock_) == EOWNERDEAD) {
+      pthread_mutex_consistent(&control->attach_lock_);
+    }
+    RegisterAttacher(control, getpid(), false);
+    pthread_mutex_unlock(&control->attach_lock_);
+  }
+  instances_mutex.unlock();
+}
+
+vcalloc::vcalloc(const Options &options) {
+  const key_t key = options.key;
+  const size_t size = options.size;
+
+  // A segment created here is fresh and therefore zero-filled
+  int shmid = shmget(key, size, IPC_CREAT | IPC_EXCL | 0666);
+  const bool created = shmid >= 0;
+  if (!created) {
+    shmid = shmget(key, size, IPC_CREAT | 0666);
+  }
+  if (shmid < 0) {
     exit(1);
   }
   void *mem = (void *)shmat(shmid, 0, 0);
-  if (mem == NULL) {
+  if (mem == (void *)-1) {
     exit(1);
   }
   CheckMem(mem);
 
   std::ptrdiff_t control_mem = std::ptrdiff_t(mem);
   control_ = reinterpret_cast<ControlHeader *>(control_mem);
-  if (shminfo.shm_nattch == 0) {
-    control_->Init();
-    control_->InitPool((void *)(control_mem + sizeof(ControlHeader)),
-                       size - sizeof(ControlHeader));
+
+  for (int i = 0; i < kMaxAsyncWaiters; i++) {
+    async_fds_[i] = -1;
+    async_signalled_[i] = false;
   }
+  async_bridge_started_ = false;
+  async_bridge_stop_ = false;
+
+  static std::once_flag at_fork;
+  std::call_once(at_fork, [] {
+    pthread_atfork(AtForkPrepare, AtForkParent, AtForkChild);
+  });
+  bool attached;
+  {
+    // Held while attaching, so a fork never copies an attach_lock_ that
+    // a thread of this process holds
+    std::lock_guard<std::mutex> guard(instances_mutex);
+    attached = AttachSegment(shmid, control_, options, created);
+    if (attached) {
+      next_instance_ = instances;
+      instances = this;
+    }
+  }
+  // Not under instances_mutex, exit runs the global allocator's destructor
+  if (!attached) {
+    fprintf(stderr,
+            "vcalloc: segment 0x%x was laid out by another vcalloc "
+            "version, remove it with ipcrm\n",
+            (unsigned int)key);
+    exit(1);
+  }
+
+  region_count_ = control_->region_count_;
+  region_size_ = control_->region_size_;
+  for (int i = 0; i < kMaxNumaNodes; i++) {
+    node_region_[i] = 0;
+  }
+  for (int i = 0; i < region_count_; i++) {
+    regions_[i] = reinterpret_cast<ControlHeader *>(control_mem +
+                                                    i * region_size_);
+    const int node = regions_[i]->node_;
+    if (node >= 0 && node < kMaxNumaNodes) {
+      node_region_[node] = i;
+    }
+  }
+
+  pressure_handler_count_ = 0;
+#if defined(VCALLOC_STATISTIC)
+  // Changes before attaching are not replayed, see UnderPressure
+  pressure_seen_ = __atomic_load_n(&control_->pressure_epoch_,
+                                   __ATOMIC_ACQUIRE);
+#else
+  pressure_seen_ = 0;
+#endif
+
+#if defined(VCALLOC_TRACE)
+  const char *trace_file = std::getenv("VCALLOC_TRACE_FILE");
+  if (trace_file) {
+    TraceOpen(trace_file);
+  }
+#endif
+
+#if defined(VCALLOC_PROFILE)
+  const char *profile_rate = std::getenv("VCALLOC_PROFILE_RATE");
+  const char *profile_signal = std::getenv("VCALLOC_PROFILE_SIGNAL");
+  const char *profile_file = std::getenv("VCALLOC_PROFILE_FILE");
+  if (profile_rate) {
+    ProfileInit(strtoull(profile_rate, nullptr, 0),
+                profile_signal ? atoi(profile_signal) : 0,
+                profile_file ? profile_file : "vcalloc.heap");
+  }
+#endif
 }
 
-void *vcalloc::Malloc(size_t size) {
+vcalloc::~vcalloc() {
+  // Reserved blocks would leak and the bridge would outlive this
+  for (int i = 0; i < kMaxAsyncWaiters; i++) {
+    if (async_fds_[i] >= 0) {
+      CancelAsync(async_fds_[i]);
+    }
+  }
+  if (async_bridge_started_) {
+    WaitQueue &queue = control_->wait_queue_;
+    async_bridge_stop_.store(true, std::memory_order_release);
+    // Changing served_ keeps a bridge about to wait from sleeping through
+    // the wake-up; other processes' bridges only rescan their requests
+    __atomic_add_fetch(&queue.served_, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &queue.served_, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+    pthread_join(async_bridge_, nullptr);
+    async_bridge_started_ = false;
+  }
+
+  std::lock_guard<std::mutex> guard(instances_mutex);
+  for (vcalloc **link = &instances; *link;
+       link = &(*link)->next_instance_) {
+    if (*link == this) {
+      *link = next_instance_;
+      break;
+    }
+  }
+}
+
+void *vcalloc::TryAllocate(size_t adjust) {
+  const int local = LocalRegion();
+  void *ptr = nullptr;
+  // Local region first, remote regions only once it is exhausted
+  for (int i = 0; i < region_count_ && !ptr; i++) {
+    ControlHeader *region = regions_[(local + i) % region_count_];
+    pthread_mutex_lock(&region->lock_);
+    BlockHeader *block = region->LocateFreeBlock(adjust);
+    if (block) {
+      ptr = region->BlockPrepareUsed(block, adjust);
+    }
+    pthread_mutex_unlock(&region->lock_);
+  }
+  return ptr;
+}
+
+void vcalloc::UpdatePressure() {
+#if defined(VCALLOC_STATISTIC)
+  if (!control_->high_watermark_) {
+    return;
+  }
+  // Other regions are read without their locks, a stale value only
+  // delays the transition to a later Malloc or Free
+  size_t used_size = 0;
+  for (int i = 0; i < region_count_; i++) {
+    used_size += __atomic_load_n(&regions_[i]->used_size_, __ATOMIC_RELAXED);
+  }
+  uint32_t pressure = __atomic_load_n(&control_->pressure_, __ATOMIC_RELAXED);
+  // Strictly below the low mark, so equal marks still give hysteresis
+  if (pressure ? used_size < control_->low_watermark_
+               : used_size >= control_->high_watermark_) {
+    // Only the process that wins the flip advances the epoch
+    if (__atomic_compare_exchange_n(&control_->pressure_, &pressure,
+                                    !pressure, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(&control_->pressure_epoch_, 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  const uint32_t epoch =
+      __atomic_load_n(&control_->pressure_epoch_, __ATOMIC_ACQUIRE);
+  uint32_t seen = pressure_seen_.load(std::memory_order_relaxed);
+  // Claiming the epoch first keeps a callback that frees memory from
+  // dispatching again
+  if (epoch == seen ||
+      !pressure_seen_.compare_exchange_strong(seen, epoch)) {
+    return;
+  }
+  const bool under_pressure = UnderPressure();
+  const int count = pressure_handler_count_.load(std::memory_order_acquire);
+  for (int i = 0; i < count; i++) {
+    pressure_handlers_[i].callback_(under_pressure, pressure_handlers_[i].arg_);
+  }
+#endif
+}
+
+bool vcalloc::AddPressureCallback(PressureCallback callback, void *arg) {
+  std::lock_guard<std::mutex> guard(pressure_mutex_);
+  const int count = pressure_handler_count_.load(std::memory_order_relaxed);
+  if (count == kMaxPressureCallbacks) {
+    return false;
+  }
+  pressure_handlers_[count].callback_ = callback;
+  pressure_handlers_[count].arg_ = arg;
+  pressure_handler_count_.store(count + 1, std::memory_order_release);
+  return true;
+}
+
+bool vcalloc::UnderPressure() {
+#if defined(VCALLOC_STATISTIC)
+  return __atomic_load_n(&control_->pressure_, __ATOMIC_ACQUIRE);
+#endif
+  return false;
+}
+
+__attribute__((always_inline)) inline void vcalloc::OnAllocate(void *ptr,
+                                                                size_t size) {
+#if defined(VCALLOC_TRACE)
+  TraceRecordOp(kTraceMalloc, size, ToOffset(ptr));
+#endif
+#if defined(VCALLOC_PROFILE)
+  ProfileMalloc(ptr, size);
+#endif
+  // Never under the queue lock, callbacks may allocate or free
+  UpdatePressure();
+  (void)ptr;
+  (void)size;
+}
+
+// Kept out of line so the profiler can skip a fixed number of frames
+__attribute__((noinline)) BlockHeader *vcalloc::AllocateBlock(size_t size) {
   const size_t adjust = AdjustRequestSize(size);
-  BlockHeader *block = nullptr;
   void *ptr = nullptr;
-  while (true) {
-    pthread_mutex_lock(&control_->lock_);
-    block = control_->LocateFreeBlock(adjust);
-    if (block == nullptr) {
-      // full, wait
-      pthread_mutex_unlock(&control_->lock_);
-      pthread_cond_wait(&control_->cond_, &control_->mtx_);
+  while (!(ptr = TryAllocate(adjust))) {
+    // Blocks reserved for exited processes are never collected
+    if (ReclaimAbandoned()) {
       continue;
     }
-    ptr = control_->BlockPrepareUsed(block, adjust);
-    pthread_mutex_unlock(&control_->lock_);
-    break;
+    // full, wait
+    pthread_cond_wait(&control_->cond_, &control_->mtx_);
   }
-  return ptr;
+  OnAllocate(ptr, size);
+  return BlockHeader::FromPtr(ptr);
 }
 
-void vcalloc::Free(void *ptr) {
+void *vcalloc::Malloc(size_t size) { return AllocateBlock(size)->ToPtr(); }
+
+vcalloc::SizedPtr vcalloc::MallocAtLeast(size_t size) {
+  SizedPtr result;
+  // AllocateBlock would wait forever for such a block
+  if (!CanEverAllocate(AdjustRequestSize(size))) {
+    result.ptr = nullptr;
+    result.usable_size = 0;
+    return result;
+  }
+  BlockHeader *block = AllocateBlock(size);
+  result.ptr = block->ToPtr();
+  result.usable_size = block->Size();
+  return result;
+}
+
+size_t vcalloc::UsableSize(const void *ptr) {
   if (!ptr) {
-    return;
+    return 0;
+  }
+  return BlockHeader::FromPtr(ptr)->Size();
+}
+
+// Whether a region could ever hold adjust bytes, AllocateBlock would
+// wait forever for anything larger
+bool vcalloc::CanEverAllocate(size_t adjust) {
+  return adjust && adjust <= region_size_ - sizeof(ControlHeader) -
+                                 2 * BlockHeader::Overhead();
+}
+
+void *vcalloc::Calloc(size_t count, size_t size) {
+  if (size && count > std::numeric_limits<size_t>::max() / size) {
+    return nullptr;
+  }
+  const size_t total = count * size;
+  // An empty request still gets a unique minimum-size block
+  if (!CanEverAllocate(AdjustRequestSize(Max(total, size_t(1))))) {
+    return nullptr;
   }
+  BlockHeader *block = AllocateBlock(Max(total, size_t(1)));
+  void *ptr = block->ToPtr();
+  // Fresh memory only needs its dirty prefix and metadata cleared
+  if (block->IsZero()) {
+    block->ClearZeroBlock(total);
+  } else {
+    memset(ptr, 0, total);
+  }
+  return ptr;
+}
 
-  pthread_mutex_lock(&control_->lock_);
+// Return a block to its region, without waking anybody
+void vcalloc::ReleaseBlock(void *ptr) {
+  ControlHeader *region = RegionOf(ptr);
+  pthread_mutex_lock(&region->lock_);
 
   BlockHeader *block = BlockHeader::FromPtr(ptr);
   assert(!block->IsFree() && "block already marked as free");
 
   block->MarkAsFree();
-  block = control_->MergePrevBlock(block);
-  block = control_->MergeNextBlock(block);
-  control_->InsertBlock(block);
+  block = region->MergePrevBlock(block);
+  block = region->MergeNextBlock(block);
+  region->InsertBlock(block);
+
+  pthread_mutex_unlock(&region->lock_);
+}
+
+void vcalloc::Free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
 
-  pthread_mutex_unlock(&control_->lock_);
+#if defined(VCALLOC_TRACE)
+  TraceRecordOp(kTraceFree, 0, ToOffset(ptr));
+#endif
+#if defined(VCALLOC_PROFILE)
+  ProfileFree(ptr);
+#endif
+
+  ReleaseBlock(ptr);
+  UpdatePressure();
+
+  // Pairs with the waiting_ increment in MallocAsync, so either we see the
+  // waiter or its own attempt sees the memory we just released
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&control_->wait_queue_.waiting_, __ATOMIC_RELAXED)) {
+    ServeWaiters();
+  }
   pthread_cond_broadcast(&control_->cond_);
 }
 
+void *vcalloc::MallocAsync(size_t size, int *fd) {
+  *fd = -1;
+  // Such a request would stall everyone queued behind it forever
+  if (!CanEverAllocate(AdjustRequestSize(size))) {
+    return nullptr;
+  }
+  // Always taken before the queue lock
+  std::lock_guard<std::mutex> guard(async_mutex_);
+  WaitQueue &queue = control_->wait_queue_;
+  pthread_mutex_lock(&queue.lock_);
+  // Enqueue before trying, so a concurrent Free cannot miss this request
+  const int slot = queue.Enqueue(getpid(), size);
+  if (slot < 0) {
+    pthread_mutex_unlock(&queue.lock_);
+    return nullptr;
+  }
+  AsyncWaiter *waiter = &queue.waiters_[slot];
+  // Requests never overtake earlier waiters
+  if (queue.Oldest() == waiter) {
+    void *ptr = TryAllocate(AdjustRequestSize(size));
+    if (ptr) {
+      queue.Leave(waiter, kAsyncFree);
+      pthread_mutex_unlock(&queue.lock_);
+      OnAllocate(ptr, size);
+      return ptr;
+    }
+  }
+  const int event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event < 0) {
+    queue.Leave(waiter, kAsyncFree);
+    pthread_mutex_unlock(&queue.lock_);
+    return nullptr;
+  }
+  async_fds_[slot] = event;
+  async_signalled_[slot] = false;
+  // Uses pthread directly, std::thread would allocate from a full heap
+  if (!async_bridge_started_ &&
+      pthread_create(&async_bridge_, nullptr, AsyncBridge, this) == 0) {
+    async_bridge_started_ = true;
+  }
+  pthread_mutex_unlock(&queue.lock_);
+  *fd = event;
+  return nullptr;
+}
+
+int vcalloc::AsyncSlot(int fd) {
+  for (int i = 0; i < kMaxAsyncWaiters; i++) {
+    if (async_fds_[i] == fd) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void *vcalloc::TakeAsync(int fd) {
+  void *ptr = nullptr;
+  size_t size = 0;
+  {
+    std::lock_guard<std::mutex> guard(async_mutex_);
+    const int slot = AsyncSlot(fd);
+    if (fd < 0 || slot < 0) {
+      return nullptr;
+    }
+    WaitQueue &queue = control_->wait_queue_;
+    AsyncWaiter &waiter = queue.waiters_[slot];
+    pthread_mutex_lock(&queue.lock_);
+    if (waiter.state_ != kAsyncReady) {
+      pthread_mutex_unlock(&queue.lock_);
+      return nullptr;
+    }
+    ptr = FromOffset(waiter.offset_);
+    size = waiter.size_;
+    waiter.state_ = kAsyncFree;
+    pthread_mutex_unlock(&queue.lock_);
+    async_fds_[slot] = -1;
+  }
+  close(fd);
+  OnAllocate(ptr, size);
+  return ptr;
+}
+
+void vcalloc::CancelAsync(int fd) {
+  void *reserved = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(async_mutex_);
+    const int slot = AsyncSlot(fd);
+    if (fd < 0 || slot < 0) {
+      return;
+    }
+    WaitQueue &queue = control_->wait_queue_;
+    AsyncWaiter &waiter = queue.waiters_[slot];
+    pthread_mutex_lock(&queue.lock_);
+    if (waiter.state_ == kAsyncWaiting) {
+      queue.Leave(&waiter, kAsyncFree);
+    } else if (waiter.state_ == kAsyncReady) {
+      reserved = FromOffset(waiter.offset_);
+      waiter.state_ = kAsyncFree;
+    }
+    pthread_mutex_unlock(&queue.lock_);
+    async_fds_[slot] = -1;
+    close(fd);
+  }
+  Free(reserved);
+}
+
+// Reserve blocks for waiters in arrival order until one does not fit
+void vcalloc::ServeWaiters() {
+  WaitQueue &queue = control_->wait_queue_;
+  bool served = false;
+  pthread_mutex_lock(&queue.lock_);
+  ReleaseAbandoned();
+  while (AsyncWaiter *waiter = queue.Oldest()) {
+    // Nobody would ever collect the block of a process that has exited
+    if (!ProcessAlive(waiter->pid_)) {
+      queue.Leave(waiter, kAsyncFree);
+      continue;
+    }
+    void *ptr = TryAllocate(AdjustRequestSize(waiter->size_));
+    if (!ptr) {
+      break;
+    }
+    waiter->offset_ = ToOffset(ptr);
+    queue.Leave(waiter, kAsyncReady);
+    served = true;
+  }
+  pthread_mutex_unlock(&queue.lock_);
+  if (served) {
+    __atomic_add_fetch(&queue.served_, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &queue.served_, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+  }
+}
+
+// Free blocks reserved for exited processes, under the queue lock
+bool vcalloc::ReleaseAbandoned() {
+  WaitQueue &queue = control_->wait_queue_;
+  bool released = false;
+  for (int i = 0; i < kMaxAsyncWaiters; i++) {
+    AsyncWaiter &waiter = queue.waiters_[i];
+    if (waiter.state_ == kAsyncReady && !ProcessAlive(waiter.pid_)) {
+      ReleaseBlock(FromOffset(waiter.offset_));
+      waiter.state_ = kAsyncFree;
+      released = true;
+    }
+  }
+  return released;
+}
+
+bool vcalloc::ReclaimAbandoned() {
+  WaitQueue &queue = control_->wait_queue_;
+  pthread_mutex_lock(&queue.lock_);
+  const bool released = ReleaseAbandoned();
+  pthread_mutex_unlock(&queue.lock_);
+  return released;
+}
+
+/*
+** One per process. Waits on the shared served_ futex and turns this
+** process's ready requests into eventfd notifications, since an eventfd
+** cannot be written from the process that performed the Free.
+*/
+void *vcalloc::AsyncBridge(void *self) {
+  vcalloc *allocator = static_cast<vcalloc *>(self);
+  WaitQueue &queue = allocator->control_->wait_queue_;
+  while (true) {
+    const uint32_t served = __atomic_load_n(&queue.served_, __ATOMIC_ACQUIRE);
+    if (allocator->async_bridge_stop_.load(std::memory_order_acquire)) {
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> guard(allocator->async_mutex_);
+      for (int i = 0; i < kMaxAsyncWaiters; i++) {
+        if (allocator->async_fds_[i] < 0 || allocator->async_signalled_[i] ||
+            __atomic_load_n(&queue.waiters_[i].state_, __ATOMIC_ACQUIRE) !=
+                kAsyncReady) {
+          continue;
+        }
+        const uint64_t one = 1;
+        if (write(allocator->async_fds_[i], &one, sizeof(one)) ==
+            sizeof(one)) {
+          allocator->async_signalled_[i] = true;
+        }
+      }
+    }
+    syscall(SYS_futex, &queue.served_, FUTEX_WAIT, served, nullptr, nullptr,
+            0);
+  }
+  return nullptr;
+}
+
+void vcalloc::Free(void *ptr, size_t size) {
+  assert((!ptr || size <= UsableSize(ptr)) && "sized free of wrong size");
+  (void)size;
+  Free(ptr);
+}
+
+int vcalloc::LocalRegion() {
+  if (region_count_ == 1) {
+    return 0;
+  }
+  const int node = CurrentNode();
+  if (node < 0 || node >= kMaxNumaNodes) {
+    return 0;
+  }
+  return node_region_[node];
+}
+
+ControlHeader *vcalloc::RegionOf(const void *ptr) {
+  if (region_count_ == 1) {
+    return control_;
+  }
+  const size_t index =
+      size_t(std::ptrdiff_t(ptr) - std::ptrdiff_t(control_)) / region_size_;
+  return regions_[index];
+}
+
 float vcalloc::GetUsageRate() {
 #if defined(VCALLOC_STATISTIC)
-  pthread_mutex_lock(&control_->lock_);
-  float usage = float(control_->used_size_) / float(control_->max_size_);
-  pthread_mutex_unlock(&control_->lock_);
+  size_t used_size = 0;
+  size_t max_size = 0;
+  for (int i = 0; i < region_count_; i++) {
+    pthread_mutex_lock(&regions_[i]->lock_);
+    used_size += regions_[i]->used_size_;
+    max_size += regions_[i]->max_size_;
+    pthread_mutex_unlock(&regions_[i]->lock_);
+  }
+  return float(used_size) / float(max_size);
+#endif
+  return 0;
+}
+
+int vcalloc::GetRegionCount() { return region_count_; }
+
+int vcalloc::GetRegionNode(int region) { return regions_[region]->node_; }
+
+float vcalloc::GetRegionUsageRate(int region) {
+#if defined(VCALLOC_STATISTIC)
+  ControlHeader *control = regions_[region];
+  pthread_mutex_lock(&control->lock_);
+  float usage = float(control->used_size_) / float(control->max_size_);
+  pthread_mutex_unlock(&control->lock_);
   return usage;
+#endif
+  (void)region;
+  return 0;
+}
+
+float vcalloc::GetFragmentation() {
+#if defined(VCALLOC_STATISTIC)
+  size_t free_size = 0;
+  size_t largest = 0;
+  for (int i = 0; i < region_count_; i++) {
+    pthread_mutex_lock(&regions_[i]->lock_);
+    free_size += regions_[i]->max_size_ - regions_[i]->used_size_;
+    largest = Max(largest, regions_[i]->LargestFreeSize());
+    pthread_mutex_unlock(&regions_[i]->lock_);
+  }
+  if (largest >= free_size) {
+    return 0;
+  }
+  return 1 - float(largest) / float(free_size);
 #endif
   return 0;
 }
 
+size_t vcalloc::GetLargestFreeSize() {
+  size_t largest = 0;
+  for (int i = 0; i < region_count_; i++) {
+    pthread_mutex_lock(&regions_[i]->lock_);
+    largest = Max(largest, regions_[i]->LargestFreeSize());
+    pthread_mutex_unlock(&regions_[i]->lock_);
+  }
+  return largest;
+}
+
+bool vcalloc::DumpProfile(const char *path) {
+#if defined(VCALLOC_PROFILE)
+  return ProfileDump(path);
+#endif
+  (void)path;
+  return false;
+}
+
 size_t vcalloc::ToOffset(void *ptr) {
   BlockHeader *block = BlockHeader::FromPtr(ptr);
   return control_->GetBlockOffset(block);
@@ -129,4 +1296,12 @@ void *operator new[](size_t size) {
 }
 
 void operator delete[](void *ptr) noexcept { Global::GetAllocator().Free(ptr); }
+
+void operator delete(void *ptr, size_t size) noexcept {
+  Global::GetAllocator().Free(ptr, size);
+}
+
+void operator delete[](void *ptr, size_t size) noexcept {
+  Global::GetAllocator().Free(ptr, size);
+}
 #endif
\ No newline at end of file
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
 #include <new>
+#include <sys/types.h>
 
 #include "vcalloc/common.h"
 #include "vcalloc/const.h"
@@ -10,16 +13,146 @@ struct ControlHeader;
 struct BlockHeader;
 
 class vcalloc {
+public:
+  struct Options {
+    key_t key = 12345;
+    size_t size = 1024 * 1024 * 512;
+    SearchPolicy search_policy = kSearchGoodFit;
+    // Allocations of at least this many bytes come from the top of the
+    // pool, 0 keeps them mixed with small objects
+    size_t large_threshold = 0;
+    // Split the segment into one region per NUMA node and serve each
+    // thread from its own node first
+    bool numa = false;
+    // Percent of the pool in use at which memory pressure is signalled,
+    // 0 disables it. Pressure ends once usage falls below low_watermark,
+    // which defaults to high_watermark.
+    unsigned int high_watermark = 0;
+    unsigned int low_watermark = 0;
+  };
+
+  // Called with true when the segment comes under memory pressure and
+  // with false once it is relieved
+  typedef void (*PressureCallback)(bool pressure, void *arg);
+
+  struct SizedPtr {
+    void *ptr;
+    // Bytes the caller may use, at least the requested size
+    size_t usable_size;
+  };
+
 private:
+  // The first region, also the base for offsets and the full-heap wait
   ControlHeader *control_;
+  ControlHeader *regions_[kMaxNumaNodes];
+  int region_count_;
+  size_t region_size_;
+  // Region serving each NUMA node
+  int node_region_[kMaxNumaNodes];
+
+  // eventfd of each of this process's MallocAsync requests, by queue slot
+  int async_fds_[kMaxAsyncWaiters];
+  bool async_signalled_[kMaxAsyncWaiters];
+  std::mutex async_mutex_;
+  bool async_bridge_started_;
+  pthread_t async_bridge_;
+  // Asks the bridge thread to exit, see the destructor
+  std::atomic<bool> async_bridge_stop_;
+  // Next instance of this process, for the fork handlers
+  vcalloc *next_instance_;
+
+  struct PressureHandler {
+    PressureCallback callback_;
+    void *arg_;
+  };
+  PressureHandler pressure_handlers_[kMaxPressureCallbacks];
+  std::atomic<int> pressure_handler_count_;
+  std::mutex pressure_mutex_;
+  // Last pressure_epoch_ this process has dispatched
+  std::atomic<uint32_t> pressure_seen_;
+
+  int LocalRegion();
+  ControlHeader *RegionOf(const void *ptr);
+  bool CanEverAllocate(size_t adjust);
+  // Allocate without waiting, nullptr if every region is exhausted
+  void *TryAllocate(size_t adjust);
+  void OnAllocate(void *ptr, size_t size);
+  int AsyncSlot(int fd);
+  void ServeWaiters();
+  void ReleaseBlock(void *ptr);
+  bool ReleaseAbandoned();
+  bool ReclaimAbandoned();
+  static void *AsyncBridge(void *self);
+  static void AtForkPrepare();
+  static void AtForkParent();
+  static void AtForkChild();
+  // Re-evaluate the watermarks after used bytes changed
+  void UpdatePressure();
+
+  // Blocks until a block of at least size bytes can be handed out
+  BlockHeader *AllocateBlock(size_t size);
 
 public:
+  // Attach using VCALLOC_MEM_NAME, VCALLOC_MEM_SIZE, VCALLOC_SEARCH_POLICY,
+  // VCALLOC_LARGE_THRESHOLD, VCALLOC_NUMA, VCALLOC_HIGH_WATERMARK and
+  // VCALLOC_LOW_WATERMARK
   vcalloc();
+  explicit vcalloc(const Options &options);
+  // Cancels this instance's MallocAsync requests and stops its bridge
+  // thread; leaves the segment attached
+  ~vcalloc();
 
   void *Malloc(size_t size);
+  // Like Malloc, but reports the whole block including any slack that was
+  // too small to split off. Returns {nullptr, 0} for 0 or for a size that
+  // can never fit in the pool.
+  SizedPtr MallocAtLeast(size_t size);
+  // Zero-filled; memory never written since the segment was created is
+  // not cleared again. Returns nullptr if count * size overflows or can
+  // never fit in the pool.
+  void *Calloc(size_t count, size_t size);
   void Free(void *ptr);
+  /*
+  ** Never blocks. Returns memory if it is available right away. Otherwise
+  ** the request joins a first-come first-served queue shared by all
+  ** processes, *fd is set to an eventfd that becomes readable once a Free
+  ** has reserved a block for it, and nullptr is returned. Collect the
+  ** block with TakeAsync(fd). *fd is -1 if the queue is full or if no
+  ** region could ever hold size bytes.
+  */
+  void *MallocAsync(size_t size, int *fd);
+  // The reserved block, or nullptr if it is not ready yet; closes fd
+  // once the block has been handed out
+  void *TakeAsync(int fd);
+  // Withdraw a request, releasing its block if one was reserved
+  void CancelAsync(int fd);
+
+  // size must not exceed the usable size; checked in debug builds only
+  void Free(void *ptr, size_t size);
+  static size_t UsableSize(const void *ptr);
+
+  /*
+  ** Run callback in this process whenever the segment enters or leaves
+  ** memory pressure, whichever process crossed the watermark. It runs on
+  ** the next Malloc or Free of this process, from that thread. Returns
+  ** false once kMaxPressureCallbacks are registered. Needs
+  ** VCALLOC_STATISTIC.
+  */
+  bool AddPressureCallback(PressureCallback callback, void *arg);
+  bool UnderPressure();
 
   float GetUsageRate();
+  // Per region statistics, one region per NUMA node when Options::numa
+  int GetRegionCount();
+  // NUMA node of a region, -1 if the segment is not split
+  int GetRegionNode(int region);
+  float GetRegionUsageRate(int region);
+  // 1 - largest free block / total free space
+  float GetFragmentation();
+  size_t GetLargestFreeSize();
+  // Write the sampled live heap as collapsed stacks, needs VCALLOC_PROFILE
+  // and VCALLOC_PROFILE_RATE
+  bool DumpProfile(const char *path);
   size_t ToOffset(void *ptr);
   void *FromOffset(size_t offset);
 };